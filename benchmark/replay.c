@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <time.h>
+#include <limits.h>
+
+#include "../trace.h"
+
+/*
+ * Replays a trace recorded with -o trace=FILE against a mounted rufs:
+ *
+ *	./replay [-m] TRACE MOUNTPOINT
+ *
+ * Records are issued one at a time in the order they started, so two replays
+ * of one trace issue the same calls in the same order. By default the gaps
+ * between calls are kept as recorded, -m issues them back to back instead.
+ * Traces hold no file data, writes write a fill pattern of the recorded size.
+ */
+
+#define MAX_OPEN 1024
+#define BUFSIZE (1 << 20)
+
+const char *op_names[TRACE_NOPS] = {
+	"", "getattr", "statfs", "readdir", "opendir", "releasedir", "mkdir", "rmdir",
+	"create", "open", "read", "write", "read_buf", "write_buf", "unlink", "truncate",
+	"ftruncate", "flush", "fsync", "fsyncdir", "utimens", "release", "ioctl", "fallocate"
+};
+
+struct op_stats {
+	unsigned long count;
+	unsigned long skipped;
+	unsigned long diverged;			/* failed now but not when recorded, or the other way */
+	uint64_t recorded_ns;
+	uint64_t replay_ns;
+};
+
+// Files the trace has open, by the inode it recorded for them
+struct open_file {
+	uint64_t ino;
+	int fd;
+	int count;
+};
+
+struct op_stats stats[TRACE_NOPS];
+struct open_file files[MAX_OPEN];
+int nfiles = 0;
+char *buf;
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int by_start(const void *a, const void *b) {
+	const struct trace_record *ra = a, *rb = b;
+	if (ra->start_ns != rb->start_ns) {
+		return ra->start_ns < rb->start_ns ? -1 : 1;
+	}
+	// ties go by thread, so the order doesn't depend on how qsort breaks them
+	return (int)ra->thread - (int)rb->thread;
+}
+
+struct open_file* file_find(uint64_t ino) {
+	int i;
+	for (i = 0; i < nfiles; i++) {
+		if (files[i].ino == ino) {
+			return &files[i];
+		}
+	}
+	return NULL;
+}
+
+// Opens path for the recorded inode, or takes another reference on its descriptor
+int file_open(uint64_t ino, const char *path, int flags, mode_t mode, int create) {
+	struct open_file *f = file_find(ino);
+	if (f != NULL) {
+		f->count++;
+		return 0;
+	}
+	if (nfiles == MAX_OPEN) {
+		return -EMFILE;
+	}
+	// read-write when the file allows it, later calls on the inode may need either
+	int fd = open(path, O_RDWR | (create ? O_CREAT : 0), mode);
+	if (fd < 0) {
+		fd = open(path, (flags & O_ACCMODE) | (create ? O_CREAT : 0), mode);
+	}
+	if (fd < 0) {
+		return -errno;
+	}
+	files[nfiles].ino = ino;
+	files[nfiles].fd = fd;
+	files[nfiles].count = 1;
+	nfiles++;
+	return 0;
+}
+
+void file_release(uint64_t ino) {
+	struct open_file *f = file_find(ino);
+	if (f == NULL || --f->count > 0) {
+		return;
+	}
+	close(f->fd);
+	*f = files[--nfiles];
+}
+
+int file_fd(uint64_t ino) {
+	struct open_file *f = file_find(ino);
+	return f != NULL ? f->fd : -1;
+}
+
+// Issues one record against the mount, returns 0 or -errno, or 1 if it was skipped
+int replay(const struct trace_record *rec, const char *mnt) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s%s", mnt, rec->path);
+	int fd = file_fd(rec->ino);
+	size_t size = rec->size < BUFSIZE ? rec->size : BUFSIZE;
+	struct stat st;
+	struct statvfs sv;
+	DIR *dir;
+	int ret = 0;
+
+	switch (rec->op) {
+	case TRACE_GETATTR:
+		ret = lstat(path, &st);
+		break;
+	case TRACE_STATFS:
+		ret = statvfs(path, &sv);
+		break;
+	case TRACE_READDIR:
+		if ((dir = opendir(path)) == NULL) {
+			return -errno;
+		}
+		while (readdir(dir) != NULL);
+		closedir(dir);
+		break;
+	case TRACE_MKDIR:
+		ret = mkdir(path, rec->flags);
+		break;
+	case TRACE_RMDIR:
+		ret = rmdir(path);
+		break;
+	case TRACE_UNLINK:
+		ret = unlink(path);
+		break;
+	case TRACE_TRUNCATE:
+		ret = truncate(path, rec->offset);
+		break;
+	case TRACE_UTIMENS:
+		ret = utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW);
+		break;
+	case TRACE_CREATE:
+		return file_open(rec->ino, path, O_RDWR, rec->flags, 1);
+	case TRACE_OPEN:
+		return file_open(rec->ino, path, rec->flags, 0, 0);
+	case TRACE_RELEASE:
+		file_release(rec->ino);
+		return 0;
+	case TRACE_READ:
+	case TRACE_READ_BUF:
+		if (fd < 0) {
+			return 1;
+		}
+		ret = pread(fd, buf, size, rec->offset) < 0 ? -1 : 0;
+		break;
+	case TRACE_WRITE:
+	case TRACE_WRITE_BUF:
+		if (fd < 0) {
+			return 1;
+		}
+		ret = pwrite(fd, buf, size, rec->offset) < 0 ? -1 : 0;
+		break;
+	case TRACE_FTRUNCATE:
+		if (fd < 0) {
+			return 1;
+		}
+		ret = ftruncate(fd, rec->offset);
+		break;
+	case TRACE_FSYNC:
+		if (fd < 0) {
+			return 1;
+		}
+		ret = rec->flags ? fdatasync(fd) : fsync(fd);
+		break;
+	case TRACE_FALLOCATE:
+		if (fd < 0) {
+			return 1;
+		}
+		ret = fallocate(fd, rec->flags, rec->offset, rec->size);
+		break;
+	default:
+		// opendir, releasedir, flush and fsyncdir have no call of their own,
+		// and ioctl arguments are not recorded
+		return 1;
+	}
+	return ret < 0 ? -errno : 0;
+}
+
+int main(int argc, char **argv) {
+	int max_speed = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "m")) != -1) {
+		if (opt == 'm') {
+			max_speed = 1;
+		} else {
+			fprintf(stderr, "usage: %s [-m] TRACE MOUNTPOINT\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (argc - optind != 2) {
+		fprintf(stderr, "usage: %s [-m] TRACE MOUNTPOINT\n", argv[0]);
+		exit(1);
+	}
+	const char *mnt = argv[optind + 1];
+
+	// Step 1: Load the trace
+	FILE *fp = fopen(argv[optind], "r");
+	if (fp == NULL) {
+		perror("fopen");
+		exit(1);
+	}
+	struct trace_header header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != TRACE_MAGIC
+			|| header.record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s: not a trace of this version\n", argv[optind]);
+		exit(1);
+	}
+	size_t nrecs = 0, cap = 4096;
+	struct trace_record *recs = malloc(cap * sizeof(struct trace_record));
+	while (recs != NULL && fread(&recs[nrecs], sizeof(struct trace_record), 1, fp) == 1) {
+		if (++nrecs == cap) {
+			cap *= 2;
+			recs = realloc(recs, cap * sizeof(struct trace_record));
+		}
+	}
+	fclose(fp);
+	buf = malloc(BUFSIZE);
+	if (recs == NULL || buf == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memset(buf, 0x61, BUFSIZE);
+
+	// Step 2: Order records of all threads by when they started
+	qsort(recs, nrecs, sizeof(struct trace_record), by_start);
+
+	// Step 3: Issue them, waiting out the recorded gaps unless at max speed
+	uint64_t begin = now_ns();
+	size_t i;
+	for (i = 0; i < nrecs; i++) {
+		const struct trace_record *rec = &recs[i];
+		if (rec->op == 0 || rec->op >= TRACE_NOPS) {
+			continue;
+		}
+		if (!max_speed) {
+			uint64_t due = begin + (rec->start_ns - recs[0].start_ns);
+			uint64_t t = now_ns();
+			if (due > t) {
+				struct timespec ts = { (due - t) / 1000000000, (due - t) % 1000000000 };
+				nanosleep(&ts, NULL);
+			}
+		}
+		struct op_stats *s = &stats[rec->op];
+		uint64_t start = now_ns();
+		int ret = replay(rec, mnt);
+		if (ret == 1) {
+			s->skipped++;
+			continue;
+		}
+		s->replay_ns += now_ns() - start;
+		s->recorded_ns += rec->latency_ns;
+		s->count++;
+		if ((ret < 0) != (rec->ret < 0)) {
+			s->diverged++;
+		}
+	}
+	uint64_t elapsed = now_ns() - begin;
+	while (nfiles > 0) {
+		close(files[--nfiles].fd);
+	}
+
+	// Step 4: Report
+	printf("%-10s %10s %8s %8s %14s %14s\n", "op", "count", "skipped", "diverged",
+			"recorded(us)", "replay(us)");
+	int op;
+	for (op = 1; op < TRACE_NOPS; op++) {
+		struct op_stats *s = &stats[op];
+		if (s->count == 0 && s->skipped == 0) {
+			continue;
+		}
+		printf("%-10s %10lu %8lu %8lu %14.2f %14.2f\n", op_names[op], s->count, s->skipped,
+				s->diverged, s->count ? s->recorded_ns / 1000.0 / s->count : 0.0,
+				s->count ? s->replay_ns / 1000.0 / s->count : 0.0);
+	}
+	printf("%zu records replayed in %.3f s\n", nrecs, elapsed / 1e9);
+	free(recs);
+	free(buf);
+	return 0;
+}
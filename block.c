@@ -6,13 +6,20 @@
  *	File:	block.c
  *
  */
+#define _GNU_SOURCE
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "block.h"
 
@@ -23,45 +30,469 @@
 
 int diskfile = -1;
 
+// Striping: with extra backing files, block numbers are spread over diskfile and
+// them RAID-0 style, stripe_unit blocks at a time. stripe_fds[0] is unused,
+// device 0 is always diskfile. Every device but 0 has a worker thread that
+// carries out its share of a bio_submit() batch.
+#define MAX_DEVS 8
+int ndevs = 1;
+int stripe_unit = 16;
+char stripe_paths[MAX_DEVS][PATH_MAX];
+int stripe_fds[MAX_DEVS];
+
+// One device's share of a bio_submit() batch
+struct bio_work {
+	struct bio *bios;
+	int n;
+	int dev;
+	struct bio_done *done;
+	struct bio_work *next;
+};
+
+// Completion of a bio_submit() batch
+struct bio_done {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pending;
+};
+
+struct stripe_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct bio_work *queue;
+	int stop;
+};
+
+struct stripe_worker workers[MAX_DEVS];
+// Open the disk file with O_DSYNC, so each block write is durable on return
+int sync_writes = 0;
+
+// Hand freed blocks back to the host, see dev_discard()
+int discard = 0;
+
+// O_DIRECT state: the disk file bypasses the host page cache, which leaves the
+// rufs block cache as the only copy in memory. Direct transfers need aligned
+// buffers, so callers with unaligned ones bounce through a pool of reusable blocks.
+#define BOUNCE_BUFS 16
+int direct_io = 0;
+char *bounce_pool = NULL;
+char *bounce_free[BOUNCE_BUFS];
+int bounce_nfree = 0;
+pthread_mutex_t bounce_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t bounce_cond = PTHREAD_COND_INITIALIZER;
+
+// RAM backend state: the whole device lives in ramdisk, and diskfile is
+// only used as a snapshot image when snapshotting is enabled
+int backend = DEV_BACKEND_FILE;
+int ram_snapshot = 0;
+char *ramdisk = NULL;
+char snapshot_path[PATH_MAX];
+
+// Selects the backend used by the next dev_init()/dev_open()
+void dev_set_backend(int type, int snapshot) {
+	backend = type;
+	ram_snapshot = snapshot;
+}
+
+// Makes every later bio_write() durable before it returns
+void dev_set_sync(int sync) {
+	sync_writes = sync;
+}
+
+// Spreads blocks over diskfile and the colon-separated backing files in paths,
+// unit blocks per stripe. Has to match the layout the device was formatted with.
+int dev_set_stripe(const char* paths, int unit) {
+	ndevs = 1;
+	stripe_unit = unit > 0 ? unit : 1;
+	while (paths != NULL && *paths != '\0') {
+		const char *end = strchr(paths, ':');
+		size_t len = end != NULL ? (size_t)(end - paths) : strlen(paths);
+		if (ndevs == MAX_DEVS || len >= PATH_MAX) {
+			fprintf(stderr, "too many or too long stripe paths\n");
+			return -1;
+		}
+		if (len > 0) {
+			memcpy(stripe_paths[ndevs], paths, len);
+			stripe_paths[ndevs][len] = '\0';
+			ndevs++;
+		}
+		paths = end != NULL ? end + 1 : NULL;
+	}
+	return 0;
+}
+
+// Reports the stripe layout in use, one device and any unit when not striping
+void dev_stripe_geometry(int *devices, int *unit) {
+	*devices = ndevs;
+	*unit = stripe_unit;
+}
+
+// Makes dev_discard() punch freed blocks out of the backing store
+void dev_set_discard(int enable) {
+	discard = enable;
+}
+
+// Opens the disk file with O_DIRECT on request. Filesystems that refuse it
+// (tmpfs, for one) get the buffered path instead.
+void dev_set_direct(int direct) {
+	direct_io = direct;
+}
+
+// Opens the disk file, with O_DIRECT when it is enabled and supported
+static int disk_open(const char* diskfile_path, int flags) {
+	flags |= sync_writes ? O_DSYNC : 0;
+	if (direct_io) {
+		int fd = open(diskfile_path, flags | O_DIRECT, S_IRUSR | S_IWUSR);
+		if (fd >= 0 || errno != EINVAL) {
+			return fd;
+		}
+		fprintf(stderr, "O_DIRECT not supported for %s, using buffered I/O\n", diskfile_path);
+		direct_io = 0;
+	}
+	return open(diskfile_path, flags, S_IRUSR | S_IWUSR);
+}
+
+// Sets up the bounce buffers, all BLOCK_SIZE aligned
+static int bounce_init() {
+	if (bounce_pool != NULL) {
+		return 0;
+	}
+	if (posix_memalign((void **)&bounce_pool, BLOCK_SIZE, (size_t)BLOCK_SIZE * BOUNCE_BUFS) != 0) {
+		bounce_pool = NULL;
+		return -1;
+	}
+	for (int i = 0; i < BOUNCE_BUFS; i++) {
+		bounce_free[i] = bounce_pool + (size_t)i * BLOCK_SIZE;
+	}
+	bounce_nfree = BOUNCE_BUFS;
+	return 0;
+}
+
+// Takes a bounce buffer, waiting for one if they are all in use
+static char* bounce_get() {
+	pthread_mutex_lock(&bounce_lock);
+	while (bounce_nfree == 0) {
+		pthread_cond_wait(&bounce_cond, &bounce_lock);
+	}
+	char *buf = bounce_free[--bounce_nfree];
+	pthread_mutex_unlock(&bounce_lock);
+	return buf;
+}
+
+static void bounce_put(char *buf) {
+	pthread_mutex_lock(&bounce_lock);
+	bounce_free[bounce_nfree++] = buf;
+	pthread_cond_signal(&bounce_cond);
+	pthread_mutex_unlock(&bounce_lock);
+}
+
+// Returns whether buf can be handed to a direct transfer as is
+static int is_aligned(const void *buf) {
+	return ((uintptr_t)buf & (BLOCK_SIZE - 1)) == 0;
+}
+
+// Maps anonymous memory for the RAM device, preferring huge pages
+static int ram_alloc() {
+	if (ramdisk != NULL) {
+		return 0;
+	}
+	// Explicit huge pages first; these fail unless the host reserved some
+	ramdisk = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (ramdisk == MAP_FAILED) {
+		// Fall back to normal pages and ask for transparent huge pages
+		ramdisk = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ramdisk == MAP_FAILED) {
+			perror("ramdisk mmap failed");
+			ramdisk = NULL;
+			return -1;
+		}
+		madvise(ramdisk, DISK_SIZE, MADV_HUGEPAGE);
+	}
+	return 0;
+}
+
+// Loads a snapshot image into the RAM device, returns -1 if there is none
+static int ram_restore(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (ram_alloc() == -1) {
+		close(fd);
+		return -1;
+	}
+	off_t done = 0;
+	while (done < DISK_SIZE) {
+		ssize_t n = pread(fd, ramdisk + done, DISK_SIZE - done, done);
+		if (n < 0) {
+			perror("snapshot restore failed");
+			close(fd);
+			return -1;
+		}
+		if (n == 0) { // short image, the rest of the device stays zeroed
+			break;
+		}
+		done += n;
+	}
+	close(fd);
+	return 0;
+}
+
+// Writes the RAM device out to the snapshot image, replacing it atomically
+static void ram_save(const char* path) {
+	char tmp_path[PATH_MAX + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	int fd = open(tmp_path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("snapshot open failed");
+		return;
+	}
+	off_t done = 0;
+	while (done < DISK_SIZE) {
+		ssize_t n = pwrite(fd, ramdisk + done, DISK_SIZE - done, done);
+		if (n <= 0) {
+			perror("snapshot write failed");
+			close(fd);
+			unlink(tmp_path);
+			return;
+		}
+		done += n;
+	}
+	if (fsync(fd) < 0 || close(fd) < 0 || rename(tmp_path, path) < 0) {
+		perror("snapshot commit failed");
+		unlink(tmp_path);
+	}
+}
+
+// Returns the fd of backing file dev
+static int dev_fd(int dev) {
+	return dev == 0 ? diskfile : stripe_fds[dev];
+}
+
+// Finds the backing file holding a block, returning its index and setting *offset
+// to the block's byte offset in that file
+static int dev_map(const int block_num, off_t *offset) {
+	if (ndevs == 1) {
+		*offset = (off_t)block_num * BLOCK_SIZE;
+		return 0;
+	}
+	int stripe = block_num / stripe_unit;
+	*offset = ((off_t)(stripe / ndevs) * stripe_unit + block_num % stripe_unit) * BLOCK_SIZE;
+	return stripe % ndevs;
+}
+
+// Size of each backing file, enough for its share of DISK_SIZE
+static off_t dev_file_size() {
+	off_t stripes = ((off_t)DISK_SIZE / BLOCK_SIZE + stripe_unit - 1) / stripe_unit;
+	return (stripes + ndevs - 1) / ndevs * stripe_unit * BLOCK_SIZE;
+}
+
+// Reads or writes one block at offset of backing file dev
+static int dev_rw(int dev, off_t offset, void *buf, int write) {
+	int fd = dev_fd(dev);
+	int retstat;
+	if (direct_io && !is_aligned(buf)) {
+		char *bounce = bounce_get();
+		if (write) {
+			memcpy(bounce, buf, BLOCK_SIZE);
+			retstat = pwrite(fd, bounce, BLOCK_SIZE, offset);
+		} else {
+			retstat = pread(fd, bounce, BLOCK_SIZE, offset);
+			if (retstat > 0) {
+				memcpy(buf, bounce, retstat);
+			}
+		}
+		bounce_put(bounce);
+	} else if (write) {
+		retstat = pwrite(fd, buf, BLOCK_SIZE, offset);
+	} else {
+		retstat = pread(fd, buf, BLOCK_SIZE, offset);
+	}
+	return retstat;
+}
+
+// Carries out the bios of a batch that belong to device dev
+static void stripe_run(struct bio *bios, int n, int dev) {
+	for (int i = 0; i < n; i++) {
+		off_t offset;
+		if (dev_map(bios[i].block_num, &offset) != dev) {
+			continue;
+		}
+		bios[i].ret = bios[i].write ? bio_write(bios[i].block_num, bios[i].buf)
+			: bio_read(bios[i].block_num, bios[i].buf);
+	}
+}
+
+static void* stripe_worker(void *arg) {
+	struct stripe_worker *w = arg;
+	int dev = w - workers;
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		while (w->queue == NULL && !w->stop) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if (w->queue == NULL) {
+			break;
+		}
+		struct bio_work *work = w->queue;
+		w->queue = work->next;
+		pthread_mutex_unlock(&w->lock);
+
+		stripe_run(work->bios, work->n, dev);
+		pthread_mutex_lock(&work->done->lock);
+		if (--work->done->pending == 0) {
+			pthread_cond_signal(&work->done->cond);
+		}
+		pthread_mutex_unlock(&work->done->lock);
+
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+// Opens the extra backing files and starts their workers. With create, missing
+// files are created; otherwise every one of them has to exist.
+static int stripe_open(int create) {
+	for (int dev = 1; dev < ndevs; dev++) {
+		stripe_fds[dev] = disk_open(stripe_paths[dev], O_RDWR | (create ? O_CREAT : 0));
+		if (stripe_fds[dev] < 0) {
+			perror(stripe_paths[dev]);
+			while (--dev > 0) {
+				close(stripe_fds[dev]);
+			}
+			return -1;
+		}
+		if (create) {
+			ftruncate(stripe_fds[dev], dev_file_size());
+		}
+	}
+	for (int dev = 1; dev < ndevs; dev++) {
+		struct stripe_worker *w = &workers[dev];
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		w->queue = NULL;
+		w->stop = 0;
+		pthread_create(&w->thread, NULL, stripe_worker, w);
+	}
+	return 0;
+}
+
+static void stripe_close() {
+	for (int dev = 1; dev < ndevs; dev++) {
+		struct stripe_worker *w = &workers[dev];
+		pthread_mutex_lock(&w->lock);
+		w->stop = 1;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+		close(stripe_fds[dev]);
+		stripe_fds[dev] = -1;
+	}
+}
+
 //Creates a file which is your new emulated disk
 void dev_init(const char* diskfile_path) {
+	if (backend == DEV_BACKEND_RAM) {
+		strncpy(snapshot_path, diskfile_path, PATH_MAX - 1);
+		if (ram_alloc() == -1) {
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+
     if (diskfile >= 0) {
 		  return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
+    diskfile = disk_open(diskfile_path, O_CREAT | O_RDWR);
+    if (diskfile < 0 || (direct_io && bounce_init() == -1)) {
 		perror("disk_open failed");
 		exit(EXIT_FAILURE);
     }
 	
-    ftruncate(diskfile, DISK_SIZE);
+    ftruncate(diskfile, dev_file_size());
+	if (stripe_open(1) == -1) {
+		exit(EXIT_FAILURE);
+	}
 }
 
 //Function to open the disk file
 int dev_open(const char* diskfile_path) {
+	if (backend == DEV_BACKEND_RAM) {
+		// Without a snapshot to restore from, the caller formats a fresh device
+		strncpy(snapshot_path, diskfile_path, PATH_MAX - 1);
+		if (ramdisk != NULL) {
+			return 0;
+		}
+		if (!ram_snapshot) {
+			return -1;
+		}
+		return ram_restore(diskfile_path);
+	}
+
     if (diskfile >= 0) {
 		return 0;
     }
     
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = disk_open(diskfile_path, O_RDWR);
     if (diskfile < 0) {
 		  perror("disk_open failed");
 		  return -1;
     }
+	if (direct_io && bounce_init() == -1) {
+		perror("bounce buffer allocation failed");
+		close(diskfile);
+		diskfile = -1;
+		return -1;
+	}
+	// DISKFILE holds the superblock, so it exists; a missing stripe member
+	// must not be mistaken for a device that still needs formatting
+	if (stripe_open(0) == -1) {
+		fprintf(stderr, "stripe set incomplete, refusing to mount\n");
+		exit(EXIT_FAILURE);
+	}
 	return 0;
 }
 
 void dev_close() {
+	if (ramdisk != NULL) {
+		if (ram_snapshot) {
+			ram_save(snapshot_path);
+		}
+		munmap(ramdisk, DISK_SIZE);
+		ramdisk = NULL;
+	}
     if (diskfile >= 0) {
+		stripe_close();
 		close(diskfile);
+		diskfile = -1;
     }
+	if (bounce_pool != NULL) {
+		free(bounce_pool);
+		bounce_pool = NULL;
+		bounce_nfree = 0;
+	}
 }
 
 // Read a block from the disk
 int bio_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+	if (ramdisk != NULL) {
+		if (block_num < 0 || (off_t)(block_num + 1) * BLOCK_SIZE > DISK_SIZE) {
+			memset(buf, 0, BLOCK_SIZE);
+			fprintf(stderr, "block_read failed: block %d out of range\n", block_num);
+			return -1;
+		}
+		memcpy(buf, ramdisk + (off_t)block_num * BLOCK_SIZE, BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+	off_t offset;
+	int dev = dev_map(block_num, &offset);
+	retstat = dev_rw(dev, offset, buf, 0);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
@@ -74,10 +505,176 @@ int bio_read(const int block_num, void *buf) {
 // Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+	if (ramdisk != NULL) {
+		if (block_num < 0 || (off_t)(block_num + 1) * BLOCK_SIZE > DISK_SIZE) {
+			fprintf(stderr, "block_write failed: block %d out of range\n", block_num);
+			return -1;
+		}
+		memcpy(ramdisk + (off_t)block_num * BLOCK_SIZE, buf, BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+	off_t offset;
+	int dev = dev_map(block_num, &offset);
+	retstat = dev_rw(dev, offset, (void *)buf, 1);
     if (retstat < 0) {
 		    perror("block_write failed");
     }
     return retstat;
 }
 
+// Reads and writes a batch of blocks. When striping, each device's share runs in
+// parallel with the others; the caller's thread handles device 0 itself.
+void bio_submit(struct bio *bios, int n) {
+	if (ramdisk != NULL || ndevs == 1 || n == 1) {
+		for (int i = 0; i < n; i++) {
+			bios[i].ret = bios[i].write ? bio_write(bios[i].block_num, bios[i].buf)
+				: bio_read(bios[i].block_num, bios[i].buf);
+		}
+		return;
+	}
+	struct bio_done done = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+	struct bio_work work[MAX_DEVS];
+	int busy[MAX_DEVS] = { 0 };
+	for (int i = 0; i < n; i++) {
+		off_t offset;
+		busy[dev_map(bios[i].block_num, &offset)] = 1;
+	}
+	for (int dev = 1; dev < ndevs; dev++) {
+		if (busy[dev]) {
+			done.pending++;
+		}
+	}
+	for (int dev = 1; dev < ndevs; dev++) {
+		if (!busy[dev]) {
+			continue;
+		}
+		work[dev] = (struct bio_work){ bios, n, dev, &done, NULL };
+		struct stripe_worker *w = &workers[dev];
+		pthread_mutex_lock(&w->lock);
+		struct bio_work **tail = &w->queue;
+		while (*tail != NULL) {
+			tail = &(*tail)->next;
+		}
+		*tail = &work[dev];
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+	if (busy[0]) {
+		stripe_run(bios, n, 0);
+	}
+	pthread_mutex_lock(&done.lock);
+	while (done.pending > 0) {
+		pthread_cond_wait(&done.cond, &done.lock);
+	}
+	pthread_mutex_unlock(&done.lock);
+}
+
+// Returns the file descriptor holding a block, with its byte offset in *offset,
+// so callers can splice to and from the device. -1 if the backend has no fd, or
+// if it is opened with O_DIRECT, which unaligned splice buffers would break.
+int dev_block_fd(const int block_num, off_t *offset) {
+	if (ramdisk != NULL || diskfile < 0 || direct_io) {
+		return -1;
+	}
+	return dev_fd(dev_map(block_num, offset));
+}
+
+// Punches len bytes at offset out of backing file dev
+static int dev_punch(int dev, off_t offset, off_t len) {
+	if (fallocate(dev_fd(dev), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) < 0) {
+		if (errno == EOPNOTSUPP) {
+			fprintf(stderr, "host filesystem can't punch holes, discard disabled\n");
+			discard = 0;
+			return 0;
+		}
+		perror("discard failed");
+		return -1;
+	}
+	return 0;
+}
+
+// Tells the backing store that blocks [block_num, block_num + nblocks) hold nothing
+// any more, so the host gets their space and page cache back: their extents are
+// punched out of the backing files, or their pages dropped on the RAM backend.
+// They read back as zeros. Does nothing unless enabled with dev_set_discard().
+int dev_discard(const int block_num, const int nblocks) {
+	if (!discard || nblocks <= 0) {
+		return 0;
+	}
+	if (ramdisk != NULL) {
+		madvise(ramdisk + (off_t)block_num * BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE, MADV_DONTNEED);
+		return 0;
+	}
+	if (diskfile < 0) {
+		return 0;
+	}
+	// a stripe unit is contiguous in its device's file, and so are the units one
+	// device holds in consecutive rows: gather one extent per device
+	off_t start[MAX_DEVS], end[MAX_DEVS];
+	for (int dev = 0; dev < ndevs; dev++) {
+		start[dev] = end[dev] = -1;
+	}
+	int ret = 0;
+	int last = block_num + nblocks;
+	for (int b = block_num; b < last; ) {
+		int run = ndevs == 1 ? last - b : stripe_unit - b % stripe_unit;
+		if (run > last - b) {
+			run = last - b;
+		}
+		off_t offset;
+		int dev = dev_map(b, &offset);
+		if (offset != end[dev]) {
+			if (start[dev] != -1 && dev_punch(dev, start[dev], end[dev] - start[dev]) < 0) {
+				ret = -1;
+			}
+			start[dev] = offset;
+		}
+		end[dev] = offset + (off_t)run * BLOCK_SIZE;
+		b += run;
+	}
+	for (int dev = 0; dev < ndevs; dev++) {
+		if (start[dev] != -1 && discard && dev_punch(dev, start[dev], end[dev] - start[dev]) < 0) {
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+// Makes every block written so far durable
+int dev_sync() {
+	if (diskfile < 0) {
+		return 0;
+	}
+	for (int dev = 0; dev < ndevs; dev++) {
+		if (fdatasync(dev_fd(dev)) < 0) {
+			perror("disk sync failed");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Waits until writes to a range of blocks have reached the device. Unlike dev_sync()
+// this does not flush the disk file's own metadata or the drive's write cache,
+// which makes it a cheap ordering barrier between two groups of writes.
+int dev_sync_range(const int block_num, const int nblocks) {
+	if (diskfile < 0 || nblocks <= 0) {
+		return 0;
+	}
+	// on every device, the rows of stripes the range touches
+	off_t row = (off_t)stripe_unit * ndevs;
+	off_t start = block_num / row * stripe_unit * BLOCK_SIZE;
+	off_t end = ((block_num + nblocks - 1) / row + 1) * stripe_unit * BLOCK_SIZE;
+	if (ndevs == 1) {
+		start = (off_t)block_num * BLOCK_SIZE;
+		end = start + (off_t)nblocks * BLOCK_SIZE;
+	}
+	for (int dev = 0; dev < ndevs; dev++) {
+		if (sync_file_range(dev_fd(dev), start, end - start,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) < 0) {
+			perror("disk range sync failed");
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -10,12 +10,37 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <sys/types.h>
+
 #define BLOCK_SIZE 4096
 
+// Device backends, selected with dev_set_backend() before dev_init()/dev_open()
+#define DEV_BACKEND_FILE 0		/* blocks live in the disk file */
+#define DEV_BACKEND_RAM  1		/* blocks live in anonymous memory */
+
+// One block transfer of a bio_submit() batch
+struct bio {
+	int block_num;
+	void *buf;
+	int write;			/* 1 to write buf to the block, 0 to read it */
+	int ret;			/* what bio_read()/bio_write() would have returned */
+};
+
+void dev_set_backend(int type, int snapshot);
+void dev_set_sync(int sync);
+void dev_set_direct(int direct);
+void dev_set_discard(int enable);
+int dev_set_stripe(const char* paths, int unit);
+void dev_stripe_geometry(int *devices, int *unit);
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
 void dev_close();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+void bio_submit(struct bio *bios, int n);
+int dev_block_fd(const int block_num, off_t *offset);
+int dev_sync();
+int dev_sync_range(const int block_num, const int nblocks);
+int dev_discard(const int block_num, const int nblocks);
 
 #endif
@@ -13,384 +13,3342 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <sys/time.h>
-#include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <lz4.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "block.h"
 #include "rufs.h"
+#include "trace.h"
 
 // User-facing file system operations
 
 char diskfile_path[PATH_MAX];
+char trace_path[PATH_MAX];
+
+// Mount options understood by rufs itself (-o ram,snapshot,cache_blocks=N,...)
+struct rufs_options {
+	int ram;					/* keep the whole device in memory */
+	int snapshot;				/* with ram, restore from and save to DISKFILE */
+	int direct;					/* open DISKFILE with O_DIRECT, the block cache is the only cache */
+	int compress;				/* store the data of new files in compressed clusters */
+	char *stripe;				/* extra backing files to stripe over, colon separated */
+	int stripe_unit;			/* blocks per stripe */
+	int cache_blocks;			/* size of the block cache in blocks */
+	int dirty_expire_ms;		/* dirty blocks older than this are written back */
+	int dirty_background_ratio;	/* % of the cache dirty before the flusher starts */
+	int dirty_ratio;			/* % of the cache dirty before writers are throttled */
+	char *durability;			/* sync, ordered or writeback */
+	int discard;				/* punch freed blocks out of DISKFILE */
+	char *trace;				/* record every callback to this trace file */
+	char *atime;				/* strictatime, relatime or noatime */
+};
+
+// Durability modes, see the durability= mount option
+#define DURABILITY_WRITEBACK	0	/* metadata and data written back in any order */
+#define DURABILITY_ORDERED		1	/* data reaches the device before the metadata */
+#define DURABILITY_SYNC			2	/* every block is durable when the call returns */
+
+int durability = DURABILITY_WRITEBACK;
+
+// When reads update the access time, see the atime= mount option
+#define ATIME_RELATIME	0	/* only if not newer than mtime/ctime, or a day old */
+#define ATIME_STRICT	1	/* on every read */
+#define ATIME_NOATIME	2	/* never */
+#define RELATIME_SECS (24 * 60 * 60)
+
+int atime_policy = ATIME_RELATIME;
+
+struct rufs_options options = {
+	.cache_blocks = 4096,
+	.dirty_expire_ms = 5000,
+	.dirty_background_ratio = 10,
+	.dirty_ratio = 40,
+	.stripe_unit = 16,
+};
+
+#define RUFS_OPT(t, p, v) { t, offsetof(struct rufs_options, p), v }
+
+static const struct fuse_opt rufs_opts[] = {
+	RUFS_OPT("ram", ram, 1),
+	RUFS_OPT("snapshot", snapshot, 1),
+	RUFS_OPT("direct", direct, 1),
+	RUFS_OPT("compress", compress, 1),
+	RUFS_OPT("stripe=%s", stripe, 0),
+	RUFS_OPT("stripe_unit=%d", stripe_unit, 0),
+	RUFS_OPT("cache_blocks=%d", cache_blocks, 0),
+	RUFS_OPT("dirty_expire_ms=%d", dirty_expire_ms, 0),
+	RUFS_OPT("dirty_background_ratio=%d", dirty_background_ratio, 0),
+	RUFS_OPT("dirty_ratio=%d", dirty_ratio, 0),
+	RUFS_OPT("durability=%s", durability, 0),
+	RUFS_OPT("discard", discard, 1),
+	RUFS_OPT("trace=%s", trace, 0),
+	RUFS_OPT("atime=%s", atime, 0),
+	FUSE_OPT_END
+};
 
 // Declare your in-memory data structures here
 
 struct superblock* superblock;
+// Both bitmaps are kept in memory for the lifetime of the mount and written to
+// the block cache on change; alloc_lock guards them
 bitmap_t inode_bitmap;
 bitmap_t data_block_bitmap;
+// Bits of the bitmaps that allocation magazines hold in reserve. They are set in
+// the bitmaps above but left clear in the copies written to disk, so a crash
+// doesn't leak them; each goes to disk as it is handed out. Set under alloc_lock,
+// cleared atomically by the thread handing it out.
+unsigned char inode_reserved[BLOCK_SIZE];
+unsigned char data_block_reserved[BLOCK_SIZE];
+// Buddy index of the free data blocks, rebuilt from data_block_bitmap at mount and
+// kept in step with it under alloc_lock. buddy_head[k] lists the free runs of 2^k
+// blocks aligned to 2^k; buddy_order[i] is k if such a run starts at block i, else -1.
+int buddy_head[BUDDY_ORDERS];
+int buddy_next[MAX_DNUM];
+int buddy_prev[MAX_DNUM];
+int8_t buddy_order[MAX_DNUM];
+_Static_assert(1 << (BUDDY_ORDERS - 1) == MAX_DNUM, "the largest buddy run spans every data block");
+// References to each data block beyond the first, from files sharing it through
+// a reflink; 0 when a single file owns the block. Also kept in memory and guarded
+// by alloc_lock.
+uint16_t *block_refs;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+// Serializes the read-modify-write of inode table blocks, which hold inodes_per_block
+// inodes each.
+// Also guards superblock->i_init_blk: mkfs leaves the inode table as whatever the
+// disk held, it is zeroed a chunk at a time by the first writei() past the mark
+// or by the itable thread in the background, and readi() doesn't trust the rest.
+pthread_mutex_t itable_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_t itable_thread;
+int itable_stop;
+// Serializes changes to directories, dir_add/dir_remove re-read the directory
+// inode and its first block under it so neither entries nor Bloom filter bits are lost
+pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+// Sequence count of directory compactions, odd while one moves entries. Lookups
+// don't take dir_lock, those that raced with a compaction look again under it.
+unsigned int dir_moves;
+// Per inode, held shared by everything that only reads the file's block map, and
+// exclusively by everything that changes it: writes, truncation, fallocate, clones
+// into the file, the defragmenter and the reclaimer. Initialized by rufs_init().
+pthread_rwlock_t remap_lock[MAX_INUM];
 int inodes_per_block = BLOCK_SIZE / sizeof(struct inode);
 
-/* 
- * Get available inode number from bitmap
- */
+// Write-back block cache, every block rufs reads or writes goes through it.
+// Dirty blocks are written back by the flusher thread.
+struct cache_block {
+	int blkno;						/* -1 while the slot is unused */
+	int dirty;						/* modified since last written back */
+	int writeback;					/* being written back, must not be evicted */
+	int loading;					/* claimed by cache_readahead(), data not read yet */
+	uint64_t dirtied_ms;			/* when the block last went from clean to dirty */
+	int ino;						/* file the block belongs to, -1 for metadata */
+	struct cache_block *hash_next;
+	struct cache_block *lru_prev;	/* most recently used at lru_head */
+	struct cache_block *lru_next;
+	char *data;
+};
 
-void superblock_init() {
-	superblock->magic_num = MAGIC_NUM;
-	superblock->max_inum = MAX_INUM;
-	superblock->max_dnum = MAX_DNUM;
-	superblock->i_bitmap_blk = 1;
-	superblock->d_bitmap_blk = 2;
-	superblock->i_start_blk = 3;
-	superblock->d_start_blk = 8;
+struct cache_block *cache;
+struct cache_block **cache_hash;
+struct cache_block *lru_head;
+struct cache_block *lru_tail;
+char *cache_data;
+int cache_size;
+int dirty_count;
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dirty_cond = PTHREAD_COND_INITIALIZER;	/* dirty_count dropped */
+pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;	/* wakes the flusher */
+pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;	/* one write-back pass at a time */
+pthread_t flush_thread;
+int flush_stop;
 
-	bio_write(0, superblock);
-}
+// Logical-to-physical block translation cache, hashed on (ino, lblk)
+#define BMAP_CACHE_SIZE 4096
+// bmap_map() leaf value meaning look up without overwriting
+#define BMAP_LOOKUP -2
 
-void inode_bitmap_init() {
-	inode_bitmap = malloc(BLOCK_SIZE);
-	memset(inode_bitmap, 0, BLOCK_SIZE);
-	bio_write(superblock->i_bitmap_blk, inode_bitmap);
-}
+struct bmap_entry {
+	int ino;
+	int lblk;
+	int pblk;
+};
 
-void data_block_bitmap_init() {
-	data_block_bitmap = malloc(BLOCK_SIZE);
-	memset(data_block_bitmap, 0, BLOCK_SIZE);
-	bio_write(superblock->d_bitmap_blk, data_block_bitmap);
+struct bmap_entry bmap_cache[BMAP_CACHE_SIZE];
+pthread_mutex_t bmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Data blocks waiting to be returned to the bitmap together
+struct block_batch {
+	int *blocks;
+	int count;
+	int capacity;
+};
+
+// Freed data blocks waiting for their discard. A hole punched while the inode or
+// pointer block that stopped mapping a block is still only in the cache would be
+// data loss if the mount crashed, so holes are only punched once a full write-back
+// and device sync have run since the blocks were freed; the reclaimer runs such a
+// pass once per dirty_expire_ms while any wait. Until then they are held like
+// magazine reservations: set in the in-memory bitmap, clear on disk.
+// discard_lock guards both lists, discard_blocks counts them under alloc_lock.
+struct block_batch discard_queue;	/* freed since the last discard pass */
+struct block_batch discard_aged;	/* freed before it, punched by the next one */
+int discard_blocks;
+uint64_t discard_last_ms;			/* when the last discard pass started */
+int discard_running;				/* a pass holds blocks taken off both lists */
+pthread_mutex_t discard_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t discard_cond = PTHREAD_COND_INITIALIZER;
+
+// Truncations that would free more blocks than this hand whole pointer trees
+// to the reclaimer thread instead of freeing them before returning
+#define RECLAIM_DEFER_BLOCKS 4096
+
+// Data blocks a file stops mapping are freed this long after, when reads can be
+// spliced: those hand FUSE extents of the device file that it copies only once
+// rufs_read_buf() has returned, so they can still be in flight.
+#define SPLICE_GRACE_MS 1000
+
+// Work for the reclaimer: either a detached pointer tree `levels` deep rooted at
+// block ptr, or (ino != -1) an unlinked inode to free along with all its blocks,
+// or (blocks != NULL) count data blocks to free. Trees and blocks wait till due_ms.
+struct reclaim_job {
+	int ptr;
+	int levels;
+	int ino;
+	int *blocks;
+	int count;
+	uint64_t due_ms;
+	struct reclaim_job *next;
+};
+
+struct reclaim_job *reclaim_queue;
+int reclaim_stop;
+pthread_t reclaim_thread;
+pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+// Jobs waiting out their grace period, allocation that finds no free block waits
+// on reclaim_done_cond for the reclaimer to free them. Both under reclaim_lock.
+int reclaim_held;
+pthread_cond_t reclaim_done_cond = PTHREAD_COND_INITIALIZER;
+// Open handles by inode number. An inode unlinked while open stays allocated, as
+// an orphan, until its last handle is released. open_lock guards both.
+int open_count[MAX_INUM];
+uint8_t orphan[MAX_INUM];
+pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Decompressed clusters of compressed files, so the codec runs once per cluster
+// rather than once per block read. Entries of a file are dropped whenever its
+// block map changes. zcache_lock guards them.
+#define ZCACHE_CLUSTERS 8
+
+struct zcache_entry {
+	int ino;					/* -1 when unused */
+	int cluster;
+	uint64_t used;				/* LRU stamp */
+	char *data;					/* CLUSTER_SIZE bytes */
+};
+
+struct zcache_entry zcache[ZCACHE_CLUSTERS];
+uint64_t zcache_clock;
+pthread_mutex_t zcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Compressed clusters a partial write turned into plain blocks. They stay plain
+// until the file is released, so a run of small writes into one cluster costs a
+// single expansion and a single recompression. When the table is full the writer
+// compresses the cluster again right away. recompress_lock guards it.
+#define RECOMPRESS_SLOTS 64
+
+struct recompress_entry {
+	int ino;
+	int cluster;
+};
+
+struct recompress_entry recompress[RECOMPRESS_SLOTS];
+int nrecompress;
+pthread_mutex_t recompress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * block cache
+ */
+
+static uint64_t now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-// calculates the inode block number
-int calc_inode_block_no(int ino_no) {
-	int starting_block = superblock->i_start_blk;
-	return (starting_block + (ino_no / inodes_per_block));
+void cache_init(int nblocks) {
+	cache_size = nblocks;
+	cache = calloc(nblocks, sizeof(struct cache_block));
+	cache_hash = calloc(nblocks, sizeof(struct cache_block *));
+	// one block-aligned area for all cached data
+	posix_memalign((void **)&cache_data, BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE);
+	lru_head = NULL;
+	lru_tail = NULL;
+	for (int i = 0; i < nblocks; i++) {
+		cache[i].blkno = -1;
+		cache[i].data = cache_data + (size_t)i * BLOCK_SIZE;
+		// every slot starts on the LRU list, unused slots are reused first
+		cache[i].lru_prev = lru_tail;
+		cache[i].lru_next = NULL;
+		if (lru_tail != NULL) {
+			lru_tail->lru_next = &cache[i];
+		} else {
+			lru_head = &cache[i];
+		}
+		lru_tail = &cache[i];
+	}
+	dirty_count = 0;
 }
 
-// calculates the byte offset for the specific inode
-int calc_inode_offset(int ino_no) {
-	return ((ino_no % inodes_per_block) * sizeof(struct inode));
+void cache_destroy() {
+	free(cache);
+	free(cache_hash);
+	free(cache_data);
+	cache = NULL;
 }
 
-void root_inode_init() {
-	struct inode root_inode;
-	root_inode.ino = 0;
-	root_inode.valid = 1;
-	root_inode.size = BLOCK_SIZE;
-	root_inode.type = S_IFDIR | 0755;
-	root_inode.link = 2;
-	root_inode.direct_ptr[0] = superblock->d_start_blk;
-	// initializing other ptrs to -1 to indicate unused
-	for (int i = 1; i < 16; i++) {
-		root_inode.direct_ptr[i] = -1;
-	}
-	for (int i = 0; i < 8; i++) {
-		root_inode.indirect_ptr[i] = -1;
+static struct cache_block* cache_lookup(int blkno) {
+	struct cache_block *cb = cache_hash[blkno % cache_size];
+	while (cb != NULL && cb->blkno != blkno) {
+		cb = cb->hash_next;
 	}
-	// Writing to disk
-	int inode_block_no = calc_inode_block_no(root_inode.ino);
-	int inode_offset = calc_inode_offset(root_inode.ino);
-	char inode_block[BLOCK_SIZE];
-	// Reading block from disk
-	bio_read(inode_block_no, inode_block);
-	// Modifying the block in memory
-	memcpy(inode_block + inode_offset, &root_inode, sizeof(struct inode));
-	// Writing block back to disk
-	bio_write(inode_block_no, inode_block);
+	return cb;
 }
 
-// Turns a path into an array of strings
-char** parse_path(const char* path) {
-	int index = 0; // number of strings in array
-	int capacity = 32;
-	char** array = malloc(sizeof(char*) * capacity); // array returned
-	char string[256]; // temporary string
-	int path_ptr = 0;
-	int string_ptr = 0;
-	// if absolute path, set index 0 to "/"
-	if (path[0] == '/') {
-		array[index] = strdup("/");
-		index++;
-		path_ptr++;
+static void lru_unlink(struct cache_block *cb) {
+	if (cb->lru_prev != NULL) {
+		cb->lru_prev->lru_next = cb->lru_next;
+	} else {
+		lru_head = cb->lru_next;
 	}
-
-	// Iterate through path string
-	while(path[path_ptr] != '\0') {
-		if (path[path_ptr] == '/') { // if '/', you reached the end of the string
-			string[string_ptr] = '\0'; // null terminate the string
-			array[index] = strdup(string);
-			string_ptr = 0; // reset inner pointer
-			index++;
-		} else { // else, copy the character into temp
-			string[string_ptr] = path[path_ptr];
-			string_ptr++;
-		}
-		path_ptr++;
+	if (cb->lru_next != NULL) {
+		cb->lru_next->lru_prev = cb->lru_prev;
+	} else {
+		lru_tail = cb->lru_prev;
 	}
-	// If the path doesn't end in a null terminator, add the last string
-	if (string_ptr > 0) {
-		string[string_ptr] = '\0';
-		array[index] = strdup(string);
-		index++;
+}
+
+static void lru_touch(struct cache_block *cb) {
+	if (lru_head == cb) {
+		return;
 	}
-	array[index] = NULL;
-	return array;
+	lru_unlink(cb);
+	cb->lru_prev = NULL;
+	cb->lru_next = lru_head;
+	lru_head->lru_prev = cb;
+	lru_head = cb;
 }
 
-// returns the length of a string
-int string_len(char* string) {
-	int length = 0;
-	for (int i = 0; string[i] != '\0'; i++) {
-		length++;
+static void hash_remove(struct cache_block *cb) {
+	struct cache_block **pp = &cache_hash[cb->blkno % cache_size];
+	while (*pp != cb) {
+		pp = &(*pp)->hash_next;
 	}
-	return length;
+	*pp = cb->hash_next;
 }
 
-// returns the length of an array (assuming it is null terminated)
-int array_len(char** array) {
-	int length = 0;
-	for (int i = 0; array[i] != NULL; i++) {
-		length++;
+// Returns the slot holding blkno, or a fresh one (*fresh set) taken from the least
+// recently used block that is clean and not being written back. If every block is
+// dirty, the oldest idle one is written out first. Called with cache_lock held.
+static struct cache_block* cache_slot(int blkno, int *fresh) {
+	while (1) {
+		struct cache_block *cb = cache_lookup(blkno);
+		if (cb != NULL && cb->loading) {
+			pthread_cond_wait(&dirty_cond, &cache_lock);
+			continue;
+		}
+		if (cb != NULL) {
+			*fresh = 0;
+			lru_touch(cb);
+			return cb;
+		}
+		cb = lru_tail;
+		while (cb != NULL && (cb->writeback || cb->loading || cb->dirty)) {
+			cb = cb->lru_prev;
+		}
+		if (cb == NULL) {
+			cb = lru_tail;
+			while (cb != NULL && (cb->writeback || cb->loading)) {
+				cb = cb->lru_prev;
+			}
+			if (cb == NULL) { // the whole cache is in flight, wait for the flusher
+				pthread_cond_wait(&dirty_cond, &cache_lock);
+				continue;
+			}
+			bio_write(cb->blkno, cb->data);
+			cb->dirty = 0;
+			dirty_count--;
+			pthread_cond_broadcast(&dirty_cond);
+		}
+		if (cb->blkno != -1) {
+			hash_remove(cb);
+		}
+		cb->blkno = blkno;
+		cb->hash_next = cache_hash[blkno % cache_size];
+		cache_hash[blkno % cache_size] = cb;
+		lru_touch(cb);
+		*fresh = 1;
+		return cb;
 	}
-	return length;
 }
 
-// frees the array from parse_path()
-int free_array(char** array) {
-	for (int i = 0; array[i] != NULL; i++) {
-		free(array[i]);
+// Reads a block through the cache
+int cache_read(int blkno, void *buf) {
+	int fresh;
+	pthread_mutex_lock(&cache_lock);
+	struct cache_block *cb = cache_slot(blkno, &fresh);
+	if (fresh) {
+		bio_read(blkno, cb->data);
 	}
-	free(array);
-	return 0;
+	memcpy(buf, cb->data, BLOCK_SIZE);
+	pthread_mutex_unlock(&cache_lock);
+	return BLOCK_SIZE;
 }
 
-int get_avail_ino() {
-	// Step 1: Read inode bitmap from disk
-	bio_read(superblock->i_bitmap_blk, inode_bitmap);
-	// Step 2: Traverse inode bitmap to find an available slot
-	int available_slot = -1;
-	for (int i = 0; i < superblock->max_inum; i++) {
-		if (get_bitmap(inode_bitmap, i) == 0) {
-			available_slot = i;
-			set_bitmap(inode_bitmap, i);
-			break;
+// Brings the blocks in blknos into the cache with one bio_submit(), so a large read
+// fetches from every striped device at once. Blocks already cached or being loaded,
+// including ones listed twice in blknos, are skipped.
+void cache_readahead(const int *blknos, int n) {
+	// stay well below the cache size so the batch never evicts its own slots
+	if (n > cache_size / 4) {
+		n = cache_size / 4;
+	}
+	struct bio *bios = malloc(sizeof(struct bio) * (n + 1));
+	struct cache_block **slots = malloc(sizeof(struct cache_block *) * (n + 1));
+	int nbios = 0;
+	pthread_mutex_lock(&cache_lock);
+	for (int i = 0; i < n; i++) {
+		// cache_slot() would wait for a loading slot, forever if this batch claimed it
+		struct cache_block *cb = cache_lookup(blknos[i]);
+		if (cb != NULL && cb->loading) {
+			continue;
+		}
+		int fresh;
+		cb = cache_slot(blknos[i], &fresh);
+		if (fresh) {
+			// keeps others off the slot and eviction away from it till it is read
+			cb->loading = 1;
+			slots[nbios] = cb;
+			bios[nbios++] = (struct bio){ blknos[i], cb->data, 0, 0 };
 		}
 	}
-	if (available_slot == -1) {
-		printf("No available inodes.\n");
+	pthread_mutex_unlock(&cache_lock);
+	// the reads go without cache_lock, other blocks stay usable meanwhile
+	bio_submit(bios, nbios);
+	pthread_mutex_lock(&cache_lock);
+	for (int i = 0; i < nbios; i++) {
+		slots[i]->loading = 0;
 	}
-	// Step 3: Update inode bitmap and write to disk 
-	bio_write(superblock->i_bitmap_blk, inode_bitmap);
-	return available_slot;
+	pthread_cond_broadcast(&dirty_cond);
+	pthread_mutex_unlock(&cache_lock);
+	free(slots);
+	free(bios);
 }
 
-/* 
- * Get available data block number from bitmap
- */
-int get_avail_blkno() {
-	// Step 1: Read data block bitmap from disk
-	bio_read(superblock->d_bitmap_blk, data_block_bitmap);
-	// Step 2: Traverse data block bitmap to find an available slot
-	int available_slot = -1;
-	for (int i = 0; i < superblock->max_dnum; i++) {
-		if (get_bitmap(data_block_bitmap, i) == 0) {
-			available_slot = i;
-			set_bitmap(data_block_bitmap, i);
-			break;
+// Marks a block that was just changed dirty, or writes it through in sync mode.
+// Called with cache_lock held.
+static void cache_dirty(struct cache_block *cb) {
+	if (durability == DURABILITY_SYNC) {
+		if (cb->dirty) {
+			cb->dirty = 0;
+			dirty_count--;
+		}
+		bio_write(cb->blkno, cb->data);
+	} else if (!cb->dirty) {
+		cb->dirty = 1;
+		cb->dirtied_ms = now_ms();
+		dirty_count++;
+		if (dirty_count * 100 >= cache_size * options.dirty_background_ratio) {
+			pthread_cond_signal(&flush_cond);
 		}
 	}
-	if (available_slot == -1) {
-		printf("No available data blocks.\n");
+}
+
+// Writes buf into the cache with the bits set in mask cleared, if there is one.
+// Writers wait here while more than dirty_ratio percent of the cache is dirty,
+// except the flusher itself, which would be waiting for its own writeback.
+static int cache_write_masked(int blkno, const void *buf, const unsigned char *mask, int ino) {
+	pthread_mutex_lock(&cache_lock);
+	while (dirty_count * 100 >= cache_size * options.dirty_ratio && !pthread_equal(pthread_self(), flush_thread)) {
+		pthread_cond_signal(&flush_cond);
+		pthread_cond_wait(&dirty_cond, &cache_lock);
 	}
-	// Step 3: Update data block bitmap and write to disk
-	bio_write(superblock->d_bitmap_blk, data_block_bitmap);
-	return available_slot;
+	int fresh;
+	struct cache_block *cb = cache_slot(blkno, &fresh);
+	if (mask == NULL) {
+		memcpy(cb->data, buf, BLOCK_SIZE);
+	} else {
+		for (int i = 0; i < BLOCK_SIZE; i++) {
+			cb->data[i] = ((const unsigned char *)buf)[i] & ~__atomic_load_n(&mask[i], __ATOMIC_ACQUIRE);
+		}
+	}
+	cb->ino = ino;
+	cache_dirty(cb);
+	pthread_mutex_unlock(&cache_lock);
+	return BLOCK_SIZE;
 }
 
-/* 
- * inode operations
- */
+// Writes a block of file ino (its data, pointer or directory blocks) into the cache.
+// The flusher writes it back later; in sync mode it is written through right away.
+int cache_write_ino(int blkno, const void *buf, int ino) {
+	return cache_write_masked(blkno, buf, NULL, ino);
+}
 
-// Reads corresponding on-disk inode to an in-memory inode
-int readi(uint16_t ino, struct inode *inode) {
-  // Step 1: Get the inode's on-disk block number
-	int block_no = calc_inode_block_no(ino);
-  // Step 2: Get offset of the inode in the inode on-disk block
-	int offset = calc_inode_offset(ino);
-  // Step 3: Read the block from disk and then copy into inode structure
-	char block[BLOCK_SIZE];
-	bio_read(block_no, block);
-	memcpy(inode, block + offset, sizeof(struct inode));
+// Writes a bitmap into the cache without the bits set in reserved
+int cache_write_bitmap(int blkno, const void *bitmap, const unsigned char *reserved) {
+	return cache_write_masked(blkno, bitmap, reserved, -1);
+}
 
-	return 0;
+// Sets bit i of the cached copy of bitmap block blkno. Composed under cache_lock
+// with cache_write_bitmap(), so once the caller has cleared the bit in the
+// reserved mask, no bitmap written afterwards can lose it.
+void cache_set_bit(int blkno, int i) {
+	pthread_mutex_lock(&cache_lock);
+	int fresh;
+	struct cache_block *cb = cache_slot(blkno, &fresh);
+	if (fresh) {
+		bio_read(blkno, cb->data);
+	}
+	cb->data[i / 8] |= 1 << (i & 7);
+	cb->ino = -1;
+	cache_dirty(cb);
+	pthread_mutex_unlock(&cache_lock);
 }
 
-// Writes the in-memory inode to the disk inode
-int writei(uint16_t ino, struct inode *inode) {
-	// Step 1: Get the block number where this inode resides on disk
-	int block_no = calc_inode_block_no(ino);
-	// Step 2: Get the offset in the block where this inode resides on disk
-	int offset = calc_inode_offset(ino);
-	// Step 3: Write inode to disk 
-	char block[BLOCK_SIZE];
-	bio_read(block_no, block);
-	memcpy(block + offset, inode, sizeof(struct inode));
-	bio_write(block_no, block);
+// Writes a metadata block into the cache
+int cache_write(int blkno, const void *buf) {
+	return cache_write_ino(blkno, buf, -1);
+}
 
-	return 0;
+// Copies a block out if the cache holds a copy newer than the disk, returns 1 if so
+int cache_read_dirty(int blkno, void *buf) {
+	int found = 0;
+	pthread_mutex_lock(&cache_lock);
+	struct cache_block *cb = cache_lookup(blkno);
+	if (cb != NULL && (cb->dirty || cb->writeback)) {
+		memcpy(buf, cb->data, BLOCK_SIZE);
+		found = 1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return found;
 }
 
+// Returns 1 if the cache holds blkno
+int cache_contains(int blkno) {
+	pthread_mutex_lock(&cache_lock);
+	int found = cache_lookup(blkno) != NULL;
+	pthread_mutex_unlock(&cache_lock);
+	return found;
+}
 
-/* 
- * directory operations
- */
-// Returns -1 if directory doesn't exist
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-	int entries_per_block = BLOCK_SIZE / sizeof(struct dirent);
-  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
-	struct inode* directory_inode = malloc(sizeof(struct inode));
-	readi(ino, directory_inode);
-  // Step 2: Get data block of current directory from inode
-	char block[BLOCK_SIZE];
+// Empties a slot and moves it to the cold end of the LRU list. Called with cache_lock held.
+static void cache_forget(struct cache_block *cb) {
+	if (cb->dirty) {
+		dirty_count--;
+		pthread_cond_broadcast(&dirty_cond);
+	}
+	hash_remove(cb);
+	cb->blkno = -1;
+	cb->dirty = 0;
+	lru_unlink(cb);
+	cb->lru_next = NULL;
+	cb->lru_prev = lru_tail;
+	if (lru_tail != NULL) {
+		lru_tail->lru_next = cb;
+	} else {
+		lru_head = cb;
+	}
+	lru_tail = cb;
+}
 
-	for (int i = 0; i < 16; i++) {
-		int data_block_ptr = directory_inode->direct_ptr[i];
-		if (data_block_ptr != -1) {
-			bio_read(data_block_ptr, block);
-			// Step 3: Read directory's data block and check each directory entry.
-			// If the name matches, then copy directory entry to dirent structure
-			struct dirent* entry = (struct dirent*)block;
-			for (int j = 0; j < entries_per_block; j++) {
-				if (entry[j].valid && strcmp(fname, entry[j].name) == 0) {
-					memcpy(dirent, &entry[j], sizeof(struct dirent));
-					return 0;
-				}
-			}
-		}
+// Forgets a block that was freed, its contents no longer matter
+void cache_drop(int blkno) {
+	pthread_mutex_lock(&cache_lock);
+	struct cache_block *cb = cache_lookup(blkno);
+	if (cb != NULL && !cb->writeback && !cb->loading) {
+		cache_forget(cb);
 	}
+	pthread_mutex_unlock(&cache_lock);
+}
 
-	free(directory_inode);
-	printf("No dirent found!\n");
-	return -1;
+// Forgets a clean cached copy of a block that was just written around the cache,
+// waiting out a read in flight that may have fetched the old contents
+void cache_invalidate(int blkno) {
+	pthread_mutex_lock(&cache_lock);
+	struct cache_block *cb;
+	while ((cb = cache_lookup(blkno)) != NULL && cb->loading) {
+		pthread_cond_wait(&dirty_cond, &cache_lock);
+	}
+	if (cb != NULL && !cb->dirty && !cb->writeback) {
+		cache_forget(cb);
+	}
+	pthread_mutex_unlock(&cache_lock);
 }
 
-// Writes a new directory entry into the current directory's data blocks
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
-	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
-	// Step 2: Check if fname (directory name) is already used in other entries
-	// Step 3: Add directory entry in dir_inode's data block and write to disk
-	// Allocate a new data block for this directory if it does not exist
-	// Update directory inode
-	// Write directory entry
+struct flush_entry {
+	struct cache_block *cb;
+	int blkno;
+	char *data;
+};
 
-	// Variables
-	int entries_per_block = BLOCK_SIZE / sizeof(struct dirent);
-	char data_block[BLOCK_SIZE];
-	int entry_added = 0;
+static int compare_dirty_age(const void *a, const void *b) {
+	uint64_t x = (*(struct cache_block * const *)a)->dirtied_ms;
+	uint64_t y = (*(struct cache_block * const *)b)->dirtied_ms;
+	return x < y ? -1 : x > y;
+}
 
-	// Checking to see if a directory already exists with the same name
-	struct dirent existing_entry;
-	if (dir_find(dir_inode.ino, fname, name_len, &existing_entry) == 0) {
-		printf("Directory already exists.\n");
-		return -1;
+static int compare_flush_entry(const void *a, const void *b) {
+	const struct flush_entry *x = a, *y = b;
+	if (durability == DURABILITY_ORDERED) {
+		// data region first, the metadata in front of it goes last
+		int x_meta = x->blkno < superblock->d_start_blk;
+		int y_meta = y->blkno < superblock->d_start_blk;
+		if (x_meta != y_meta) {
+			return x_meta - y_meta;
+		}
 	}
+	return x->blkno - y->blkno;
+}
 
-	// Looking for existing memory block ; only memory block needs to be written to disk
-	for (int i = 0; i < 16; i++) {
-		if (dir_inode.direct_ptr[i] != -1) { // if direct ptr exists
-			bio_read(dir_inode.direct_ptr[i], data_block); // read data block to memory
-			struct dirent* entry = (struct dirent*)data_block; // preparing to read entries
-			for (int j = 0; j < entries_per_block; j++) {
-				if (!entry[j].valid) {
-					// setting entry
-					entry[j].ino = f_ino;
-					entry[j].valid = 1;
-					strncpy(entry[j].name, fname, name_len);
-					entry[j].len = name_len;
-					// writing data block to disk
-					bio_write(dir_inode.direct_ptr[i], data_block);
-					entry_added = 1;
-					break;
-				}
+// Which dirty blocks a write-back pass takes
+#define FLUSH_AGED	0	/* expired ones, and the oldest while over the background ratio */
+#define FLUSH_ALL	1	/* every dirty block */
+#define FLUSH_INODE	2	/* one file's blocks plus the metadata describing it */
+
+// Swaps dirty[i] into the part of the array being flushed, which grows by one
+static void flush_take(struct cache_block **dirty, int i, int *nflush) {
+	struct cache_block *cb = dirty[i];
+	dirty[i] = dirty[*nflush];
+	dirty[(*nflush)++] = cb;
+}
+
+// Writes dirty blocks back in block-number order. In ordered mode data blocks go
+// first and reach the device before any metadata block is written.
+static void cache_writeback(int mode, int ino) {
+	pthread_mutex_lock(&flush_lock);
+	pthread_mutex_lock(&cache_lock);
+	struct cache_block **dirty = malloc(sizeof(struct cache_block *) * (dirty_count + 1));
+	int ndirty = 0;
+	for (int i = 0; i < cache_size; i++) {
+		struct cache_block *cb = &cache[i];
+		if (cb->dirty && !cb->writeback) {
+			dirty[ndirty++] = cb;
+		}
+	}
+	// the blocks this pass takes are moved to the front, dirty[0..nflush)
+	int nflush = ndirty;
+	if (mode == FLUSH_INODE) {
+		int inode_blkno = superblock->i_start_blk + ino / inodes_per_block;
+		nflush = 0;
+		for (int i = 0; i < ndirty; i++) {
+			struct cache_block *cb = dirty[i];
+			int refs_blk = cb->blkno >= superblock->r_start_blk && cb->blkno < superblock->d_start_blk;
+			if (cb->ino == ino || cb->blkno == inode_blkno || refs_blk
+					|| cb->blkno == superblock->i_bitmap_blk || cb->blkno == superblock->d_bitmap_blk) {
+				flush_take(dirty, i, &nflush);
 			}
-		} else { // if direct ptr does not exist, initialize it and add the entry there
-			int new_block_no = get_avail_blkno();
-			if (new_block_no == -1) {
-				printf("No available blocks on disk.\n");
-				return -1;
+		}
+	} else if (mode == FLUSH_AGED) {
+		qsort(dirty, ndirty, sizeof(struct cache_block *), compare_dirty_age);
+		uint64_t expired = now_ms() - options.dirty_expire_ms;
+		int background_limit = cache_size * options.dirty_background_ratio / 100;
+		nflush = 0;
+		while (nflush < ndirty && (dirty[nflush]->dirtied_ms <= expired || ndirty - nflush > background_limit)) {
+			nflush++;
+		}
+	}
+	if (durability == DURABILITY_ORDERED && nflush < ndirty) {
+		// An inode table block going out must not point at data still in the cache:
+		// take the dirty data of every inode in the inode blocks this pass writes,
+		// and data of no known file whenever it writes metadata at all
+		int itable_blocks = superblock->r_start_blk - superblock->i_start_blk;
+		uint8_t *itable_out = calloc(itable_blocks + 1, 1);
+		int nmeta = 0;
+		for (int i = 0; i < nflush; i++) {
+			int blkno = dirty[i]->blkno;
+			if (blkno >= (int)superblock->i_start_blk && blkno < (int)superblock->r_start_blk) {
+				itable_out[blkno - superblock->i_start_blk] = 1;
 			}
-			char new_block[BLOCK_SIZE];
-			memset(new_block, 0, BLOCK_SIZE);
-			struct dirent* entry = (struct dirent*)new_block;
-
-			entry[0].ino = f_ino;
-			entry[0].valid = 1;
-			strncpy(entry[0].name, fname, name_len);
-			entry[0].len = name_len;
+			nmeta += blkno < (int)superblock->d_start_blk;
+		}
+		for (int i = nflush; i < ndirty && nmeta > 0; i++) {
+			struct cache_block *cb = dirty[i];
+			if (cb->blkno >= (int)superblock->d_start_blk
+					&& (cb->ino == -1 || itable_out[cb->ino / inodes_per_block])) {
+				flush_take(dirty, i, &nflush);
+			}
+		}
+		free(itable_out);
+	}
+	// snapshot the data so writers can keep dirtying these blocks meanwhile
+	struct flush_entry *entries = malloc(sizeof(struct flush_entry) * (nflush + 1));
+	// aligned, so O_DIRECT writes go straight from here without a bounce buffer
+	char *staging;
+	posix_memalign((void **)&staging, BLOCK_SIZE, (size_t)BLOCK_SIZE * (nflush + 1));
+	for (int i = 0; i < nflush; i++) {
+		entries[i].cb = dirty[i];
+		entries[i].blkno = dirty[i]->blkno;
+		entries[i].data = staging + (size_t)i * BLOCK_SIZE;
+		memcpy(entries[i].data, dirty[i]->data, BLOCK_SIZE);
+		dirty[i]->dirty = 0;
+		dirty[i]->writeback = 1;
+	}
+	dirty_count -= nflush;
+	pthread_cond_broadcast(&dirty_cond);
+	pthread_mutex_unlock(&cache_lock);
 
-			dir_inode.direct_ptr[i] = new_block_no;
-			bio_write(new_block_no, new_block); // write new block to disk
-			entry_added = 1;
-			break;
+	qsort(entries, nflush, sizeof(struct flush_entry), compare_flush_entry);
+	// submitted as one batch, so striped devices are written in parallel
+	struct bio *bios = malloc(sizeof(struct bio) * (nflush + 1));
+	int nmeta = 0;
+	for (int i = 0; i < nflush; i++) {
+		bios[i] = (struct bio){ entries[i].blkno, entries[i].data, 1, 0 };
+		if (entries[i].blkno < superblock->d_start_blk) {
+			nmeta++;
 		}
 	}
-	// Return 0 if success, -1 otherwise
-	if (entry_added == 1) {
-		writei(dir_inode.ino, &dir_inode); // write updated inode to disk
-		return 0;
+	if (durability == DURABILITY_ORDERED && nmeta > 0) {
+		// data blocks are sorted first. Barrier: the data these inodes and bitmaps
+		// describe must be on the device before them. It covers the whole data
+		// region since zero-copy writes go around the cache.
+		bio_submit(bios, nflush - nmeta);
+		dev_sync_range(superblock->d_start_blk, MAX_DNUM - superblock->d_start_blk);
+		bio_submit(bios + nflush - nmeta, nmeta);
 	} else {
-		return -1;
+		bio_submit(bios, nflush);
+	}
+	free(bios);
+
+	pthread_mutex_lock(&cache_lock);
+	for (int i = 0; i < nflush; i++) {
+		entries[i].cb->writeback = 0;
 	}
+	pthread_cond_broadcast(&dirty_cond);
+	pthread_mutex_unlock(&cache_lock);
+	pthread_mutex_unlock(&flush_lock);
+	free(staging);
+	free(entries);
+	free(dirty);
 }
 
-// Required for 518
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+// Writes back every dirty block (all set), or the ones the flusher is due to write
+void cache_flush(int all) {
+	cache_writeback(all ? FLUSH_ALL : FLUSH_AGED, -1);
+}
 
-	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	
-	// Step 2: Check if fname exist
+// Makes file ino durable: its dirty data, pointer and directory blocks, its inode
+// table block, both bitmaps and the reference counts are written back, then the
+// device is synced
+int cache_sync_inode(int ino) {
+	if (durability != DURABILITY_SYNC) {
+		cache_writeback(FLUSH_INODE, ino);
+	}
+	return dev_sync() == 0 ? 0 : -EIO;
+}
+
+/*
+ * lazy timestamps
+ */
 
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+#define TIME_ATIME 0x1
+#define TIME_MTIME 0x2
+#define TIME_CTIME 0x4
+// The pending times replace the inode's even where they are older, for explicit times
+#define TIME_REPLACE 0x8
 
-	return 0;
+// Timestamps not yet in the inode table, by inode number. Updates that change
+// nothing but an inode's times land here instead of costing an inode block
+// read-modify-write per call: readi() overlays them, writei() takes them along,
+// and the flusher folds the rest in once per pass, one write per inode block.
+struct lazy_times {
+	int pending;					/* TIME_* bits set below */
+	struct timespec atime;
+	struct timespec mtime;
+	struct timespec ctime;
+};
+
+struct lazy_times lazy_times[MAX_INUM];
+int times_pending;					/* inodes with pending times */
+pthread_mutex_t times_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int timespec_after(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
 }
 
-// Returns -1 if directory is missing
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-	
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-	char** array = parse_path(path);
-	if (!array) {
-		printf("Memory allocation error for array.\n");
-		return -1;
+// Sets the times in which (TIME_*) of an in-memory inode to now, the caller writes it back
+void inode_touch(struct inode *inode, int which) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (which & TIME_ATIME) {
+		inode->vstat.st_atim = now;
+	}
+	if (which & TIME_MTIME) {
+		inode->vstat.st_mtim = now;
 	}
+	if (which & TIME_CTIME) {
+		inode->vstat.st_ctim = now;
+	}
+}
 
-	// Implementation
-	struct dirent* dirent = malloc(sizeof(struct dirent));
-	struct inode* current_inode = malloc(sizeof(struct inode));
-	int name_len;
-	readi(ino, current_inode); // reads root inode
-	for (int i = 1; array[i] != NULL; i++) {
-		name_len = string_len(array[i]);
-		if (dir_find(current_inode->ino, array[i], name_len, dirent) == -1) {
-			printf("Directory is missing.\n");
-			return -1;
-		}
-		readi(dirent->ino, current_inode);
+// Whether a read of inode should update its access time under atime_policy
+int atime_due(const struct inode *inode) {
+	if (atime_policy == ATIME_NOATIME) {
+		return 0;
+	}
+	if (atime_policy == ATIME_STRICT) {
+		return 1;
 	}
-	*inode = *current_inode;
-	printf("Retrieved node %d by path.\n", current_inode->ino);
-	free(dirent);
-	free(current_inode);
-	free_array(array);
+	const struct stat *st = &inode->vstat;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return !timespec_after(&st->st_atim, &st->st_mtim) || !timespec_after(&st->st_atim, &st->st_ctim)
+		|| now.tv_sec - st->st_atim.tv_sec >= RELATIME_SECS;
+}
 
-	return 0;
+// Applies the pending times of ino to inode, where they are newer. With clear
+// they are taken off the table, the inode is on its way to the inode block.
+static void times_merge(int ino, struct inode *inode, int clear) {
+	if (__atomic_load_n(&lazy_times[ino].pending, __ATOMIC_ACQUIRE) == 0) {
+		return;
+	}
+	pthread_mutex_lock(&times_lock);
+	struct lazy_times *t = &lazy_times[ino];
+	int replace = t->pending & TIME_REPLACE;
+	if ((t->pending & TIME_ATIME) && (replace || timespec_after(&t->atime, &inode->vstat.st_atim))) {
+		inode->vstat.st_atim = t->atime;
+	}
+	if ((t->pending & TIME_MTIME) && (replace || timespec_after(&t->mtime, &inode->vstat.st_mtim))) {
+		inode->vstat.st_mtim = t->mtime;
+	}
+	if ((t->pending & TIME_CTIME) && (replace || timespec_after(&t->ctime, &inode->vstat.st_ctim))) {
+		inode->vstat.st_ctim = t->ctime;
+	}
+	if (clear && t->pending != 0) {
+		__atomic_store_n(&t->pending, 0, __ATOMIC_RELEASE);
+		times_pending--;
+	}
+	pthread_mutex_unlock(&times_lock);
 }
 
-/* 
- * Make file system
- */
+// Forgets the pending times of ino, for inodes being freed or given explicit times
+void times_drop(int ino) {
+	pthread_mutex_lock(&times_lock);
+	if (lazy_times[ino].pending != 0) {
+		__atomic_store_n(&lazy_times[ino].pending, 0, __ATOMIC_RELEASE);
+		times_pending--;
+	}
+	pthread_mutex_unlock(&times_lock);
+}
+
+// Folds pending times into the inode table, each inode block read and written
+// once for all of its inodes. Only those of ino, unless it is -1. Without wait,
+// blocks whose itable_lock is taken are left for the next call: the flusher
+// can't wait on a writer that is throttled until the flusher gets to it.
+void times_flush(int ino, int wait) {
+	if (__atomic_load_n(&times_pending, __ATOMIC_ACQUIRE) == 0) {
+		return;
+	}
+	int first = ino == -1 ? 0 : ino;
+	int last = ino == -1 ? MAX_INUM - 1 : ino;
+	char block[BLOCK_SIZE];
+	int i = first;
+	while (i <= last) {
+		if (__atomic_load_n(&lazy_times[i].pending, __ATOMIC_ACQUIRE) == 0) {
+			i++;
+			continue;
+		}
+		// pending times only come from inodes in use, so the block is initialized
+		int block_no = superblock->i_start_blk + i / inodes_per_block;
+		int end = (i / inodes_per_block + 1) * inodes_per_block;
+		if (end > last + 1) {
+			end = last + 1;
+		}
+		if (wait) {
+			pthread_mutex_lock(&itable_lock);
+		} else if (pthread_mutex_trylock(&itable_lock) != 0) {
+			i = end;
+			continue;
+		}
+		cache_read(block_no, block);
+		for (; i < end; i++) {
+			struct inode inode;
+			char *slot = block + (i % inodes_per_block) * sizeof(struct inode);
+			memcpy(&inode, slot, sizeof(struct inode));
+			times_merge(i, &inode, 1);
+			memcpy(slot, &inode, sizeof(struct inode));
+		}
+		cache_write(block_no, block);
+		pthread_mutex_unlock(&itable_lock);
+	}
+}
+
+// Sets the times in which (TIME_*) of inode ino to times[0] (atime), times[1]
+// (mtime) and times[2] (ctime) without writing the inode. In sync mode they go
+// to the inode block right away.
+void times_set(int ino, int which, const struct timespec times[3]) {
+	pthread_mutex_lock(&times_lock);
+	struct lazy_times *t = &lazy_times[ino];
+	if (which & TIME_ATIME) {
+		t->atime = times[0];
+	}
+	if (which & TIME_MTIME) {
+		t->mtime = times[1];
+	}
+	if (which & TIME_CTIME) {
+		t->ctime = times[2];
+	}
+	if (t->pending == 0) {
+		times_pending++;
+	}
+	__atomic_store_n(&t->pending, t->pending | which, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&times_lock);
+	if (durability == DURABILITY_SYNC) {
+		times_flush(ino, 1);
+	}
+}
+
+// Sets the times in which (TIME_*) of inode ino to now, see times_set()
+void times_touch(int ino, int which) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct timespec times[3] = { now, now, now };
+	times_set(ino, which, times);
+}
+
+// Flusher thread: wakes up periodically for expired blocks, or early when the
+// dirty ratio crosses dirty_background_ratio or a writer is throttled
+static void* flusher(void *arg) {
+	pthread_mutex_lock(&cache_lock);
+	while (!flush_stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		int interval_ms = options.dirty_expire_ms / 5 > 0 ? options.dirty_expire_ms / 5 : 1;
+		deadline.tv_sec += interval_ms / 1000;
+		deadline.tv_nsec += (long)(interval_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&flush_cond, &cache_lock, &deadline);
+		if (flush_stop || (dirty_count == 0 && __atomic_load_n(&times_pending, __ATOMIC_ACQUIRE) == 0)) {
+			continue;
+		}
+		pthread_mutex_unlock(&cache_lock);
+		// pending times join the inode blocks here, and are written back with them
+		times_flush(-1, 0);
+		cache_flush(0);
+		pthread_mutex_lock(&cache_lock);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return NULL;
+}
+
+void flusher_start() {
+	flush_stop = 0;
+	pthread_create(&flush_thread, NULL, flusher, NULL);
+}
+
+void flusher_stop() {
+	pthread_mutex_lock(&cache_lock);
+	flush_stop = 1;
+	pthread_cond_signal(&flush_cond);
+	pthread_mutex_unlock(&cache_lock);
+	pthread_join(flush_thread, NULL);
+}
+
+/* 
+ * Get available inode number from bitmap
+ */
+
+void superblock_init() {
+	superblock->magic_num = MAGIC_NUM;
+	superblock->max_inum = MAX_INUM;
+	superblock->max_dnum = MAX_DNUM;
+	superblock->i_bitmap_blk = 1;
+	superblock->d_bitmap_blk = 2;
+	superblock->i_start_blk = 3;
+	// the inode region has to hold every inode, then come the reference counts
+	// of the data blocks, and data blocks start right after them
+	superblock->r_start_blk = superblock->i_start_blk + (MAX_INUM + inodes_per_block - 1) / inodes_per_block;
+	superblock->d_start_blk = superblock->r_start_blk + REFCOUNT_BLOCKS;
+	// data bitmap bit i is disk block d_start_blk + i, so only this many fit on the disk
+	superblock->max_dnum = MAX_DNUM - superblock->d_start_blk;
+	// the stripe layout has to match on every later mount
+	int devices, unit;
+	dev_stripe_geometry(&devices, &unit);
+	superblock->stripe_devs = devices;
+	superblock->stripe_unit = unit;
+	superblock->free_inodes = superblock->max_inum;
+	superblock->free_blocks = superblock->max_dnum;
+	// none of the inode table is initialized, writing the root inode starts it
+	superblock->i_init_blk = superblock->i_start_blk;
+
+	cache_write(0, superblock);
+}
+
+// Recounts the free counters from the bitmaps, for disks not cleanly unmounted
+void superblock_count_free() {
+	superblock->free_inodes = 0;
+	for (int i = 0; i < superblock->max_inum; i++) {
+		superblock->free_inodes += get_bitmap(inode_bitmap, i) == 0;
+	}
+	superblock->free_blocks = 0;
+	for (int i = 0; i < superblock->max_dnum; i++) {
+		superblock->free_blocks += get_bitmap(data_block_bitmap, i) == 0;
+	}
+}
+
+// After a crash the superblock may have missed i_init_blk moving past inodes
+// already written, so it is raised to cover every inode the bitmap has in use
+void superblock_raise_itable_mark() {
+	if (superblock->i_init_blk == 0) {
+		return;
+	}
+	for (int i = superblock->max_inum - 1; i >= 0; i--) {
+		if (get_bitmap(inode_bitmap, i)) {
+			int block_no = superblock->i_start_blk + i / inodes_per_block;
+			if (block_no >= (int)superblock->i_init_blk) {
+				// whole chunks are zeroed at a time, the rest of this one was too
+				int end = superblock->i_start_blk + ((block_no - superblock->i_start_blk) / ITABLE_INIT_CHUNK + 1) * ITABLE_INIT_CHUNK;
+				superblock->i_init_blk = end >= (int)superblock->r_start_blk ? 0 : end;
+			}
+			return;
+		}
+	}
+}
+
+// Writes the superblock to the block cache. The free counters change under
+// alloc_lock with every allocation, so they are only written here, lazily.
+void superblock_write(int clean) {
+	pthread_mutex_lock(&alloc_lock);
+	superblock->clean = clean;
+	cache_write(0, superblock);
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+// Clears the clean flag on the device itself, at mount before anything allocates.
+// Write-back and fsync() never order block 0 ahead of the bitmaps, so a flag only
+// cleared in the cache could outlive a crash next to bitmaps newer than the counters.
+int superblock_mark_dirty() {
+	superblock_write(0);
+	pthread_mutex_lock(&alloc_lock);
+	int ret = bio_write(0, superblock);
+	pthread_mutex_unlock(&alloc_lock);
+	return ret < 0 || dev_sync() != 0 ? -1 : 0;
+}
+
+// Write the bitmaps to the cache as they go to disk, magazine reservations left
+// out. Called with alloc_lock held.
+void inode_bitmap_write() {
+	cache_write_bitmap(superblock->i_bitmap_blk, inode_bitmap, inode_reserved);
+}
+
+void data_block_bitmap_write() {
+	cache_write_bitmap(superblock->d_bitmap_blk, data_block_bitmap, data_block_reserved);
+}
+
+void inode_bitmap_init() {
+	inode_bitmap = malloc(BLOCK_SIZE);
+	memset(inode_bitmap, 0, BLOCK_SIZE);
+	inode_bitmap_write();
+}
+
+void data_block_bitmap_init() {
+	data_block_bitmap = malloc(BLOCK_SIZE);
+	memset(data_block_bitmap, 0, BLOCK_SIZE);
+	data_block_bitmap_write();
+}
+
+void block_refs_init() {
+	block_refs = malloc(REFCOUNT_BLOCKS * BLOCK_SIZE);
+	memset(block_refs, 0, REFCOUNT_BLOCKS * BLOCK_SIZE);
+	for (int i = 0; i < REFCOUNT_BLOCKS; i++) {
+		cache_write(superblock->r_start_blk + i, (char *)block_refs + (size_t)i * BLOCK_SIZE);
+	}
+}
+
+// calculates the inode block number
+int calc_inode_block_no(int ino_no) {
+	int starting_block = superblock->i_start_blk;
+	return (starting_block + (ino_no / inodes_per_block));
+}
+
+// calculates the byte offset for the specific inode
+int calc_inode_offset(int ino_no) {
+	return ((ino_no % inodes_per_block) * sizeof(struct inode));
+}
+
+// Whether inode table block block_no has been initialized, itable_lock held
+static int itable_ready(int block_no) {
+	return superblock->i_init_blk == 0 || block_no < (int)superblock->i_init_blk;
+}
+
+// Zeroes the inode table up to and including block block_no, a chunk at a time,
+// itable_lock held. Each chunk is recorded in the superblock as it is done.
+void itable_init_upto(int block_no) {
+	char zero[BLOCK_SIZE];
+	memset(zero, 0, BLOCK_SIZE);
+	while (!itable_ready(block_no)) {
+		int start = superblock->i_init_blk;
+		int end = start + ITABLE_INIT_CHUNK;
+		if (end > (int)superblock->r_start_blk) {
+			end = superblock->r_start_blk;
+		}
+		for (int i = start; i < end; i++) {
+			cache_write(i, zero);
+		}
+		// past the last chunk the whole table is initialized
+		superblock->i_init_blk = end == (int)superblock->r_start_blk ? 0 : end;
+		superblock_write(0);
+	}
+}
+
+// Zeroes what is left of the inode table a chunk at a time, then warms the cache
+// with the blocks holding inodes in use
+static void* itable_initer(void *arg) {
+	while (1) {
+		pthread_mutex_lock(&itable_lock);
+		int done = itable_stop || superblock->i_init_blk == 0;
+		if (!done) {
+			itable_init_upto(superblock->i_init_blk);
+		}
+		pthread_mutex_unlock(&itable_lock);
+		if (done) {
+			break;
+		}
+	}
+	pthread_mutex_lock(&alloc_lock);
+	int last = -1;
+	for (int i = 0; i < superblock->max_inum; i++) {
+		if (get_bitmap(inode_bitmap, i)) {
+			last = i;
+		}
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	int n = last < 0 ? 0 : last / inodes_per_block + 1;
+	int *blknos = malloc(sizeof(int) * (n + 1));
+	for (int i = 0; i < n; i++) {
+		blknos[i] = superblock->i_start_blk + i;
+	}
+	if (!itable_stop) {
+		cache_readahead(blknos, n);
+	}
+	free(blknos);
+	return NULL;
+}
+
+void itable_start() {
+	itable_stop = 0;
+	pthread_create(&itable_thread, NULL, itable_initer, NULL);
+}
+
+// Stops the itable thread, what it has not zeroed yet is left for the next mount
+void itable_finish() {
+	pthread_mutex_lock(&itable_lock);
+	itable_stop = 1;
+	pthread_mutex_unlock(&itable_lock);
+	pthread_join(itable_thread, NULL);
+}
+
+void root_inode_init() {
+	struct inode root_inode;
+	memset(&root_inode, 0, sizeof(struct inode));
+	root_inode.ino = 0;
+	root_inode.valid = 1;
+	root_inode.size = BLOCK_SIZE;
+	root_inode.type = S_IFDIR | 0755;
+	root_inode.link = 2;
+	root_inode.direct_ptr[0] = superblock->d_start_blk;
+	root_inode.vstat.st_blocks = BLOCK_SIZE / 512;
+	inode_touch(&root_inode, TIME_ATIME | TIME_MTIME | TIME_CTIME);
+	// initializing other ptrs to -1 to indicate unused
+	for (int i = 1; i < 16; i++) {
+		root_inode.direct_ptr[i] = -1;
+	}
+	for (int i = 0; i < 8; i++) {
+		root_inode.indirect_ptr[i] = -1;
+	}
+	// no entries yet, an empty filter is exact
+	struct dirent_block empty_block;
+	memset(&empty_block, 0, sizeof(empty_block));
+	empty_block.bloom_valid = 1;
+	cache_write_ino(root_inode.direct_ptr[0], &empty_block, root_inode.ino);
+	// Writing to disk
+	int inode_block_no = calc_inode_block_no(root_inode.ino);
+	int inode_offset = calc_inode_offset(root_inode.ino);
+	char inode_block[BLOCK_SIZE];
+	pthread_mutex_lock(&itable_lock);
+	itable_init_upto(inode_block_no);
+	// Reading block from disk
+	cache_read(inode_block_no, inode_block);
+	// Modifying the block in memory
+	memcpy(inode_block + inode_offset, &root_inode, sizeof(struct inode));
+	// Writing block back to disk
+	cache_write(inode_block_no, inode_block);
+	pthread_mutex_unlock(&itable_lock);
+}
+
+// Returns the next component of the path at *cursor with its length in *len and
+// moves the cursor past it, or NULL when the path has no components left.
+// Components point into the path itself, repeated slashes are skipped.
+const char* path_next(const char **cursor, size_t *len) {
+	const char *p = *cursor;
+	while (*p == '/') {
+		p++;
+	}
+	if (*p == '\0') {
+		*cursor = p;
+		return NULL;
+	}
+	const char *end = p;
+	while (*end != '\0' && *end != '/') {
+		end++;
+	}
+	*len = end - p;
+	*cursor = end;
+	return p;
+}
+
+// Splits path into its parent directory, the first *parent_len bytes of path,
+// and its last component, returned with its length in *base_len. Returns NULL
+// if the path has no last component (it names the root).
+const char* path_split(const char *path, size_t *parent_len, size_t *base_len) {
+	size_t end = strlen(path);
+	while (end > 0 && path[end - 1] == '/') {
+		end--;
+	}
+	size_t start = end;
+	while (start > 0 && path[start - 1] != '/') {
+		start--;
+	}
+	if (start == end) {
+		return NULL;
+	}
+	*parent_len = start;
+	*base_len = end - start;
+	return path + start;
+}
+
+/*
+ * buddy index of free data blocks, all callers hold alloc_lock
+ */
+
+static void buddy_push(int i, int k) {
+	buddy_order[i] = k;
+	buddy_prev[i] = -1;
+	buddy_next[i] = buddy_head[k];
+	if (buddy_head[k] != -1) {
+		buddy_prev[buddy_head[k]] = i;
+	}
+	buddy_head[k] = i;
+}
+
+static void buddy_remove(int i) {
+	int k = buddy_order[i];
+	if (buddy_prev[i] != -1) {
+		buddy_next[buddy_prev[i]] = buddy_next[i];
+	} else {
+		buddy_head[k] = buddy_next[i];
+	}
+	if (buddy_next[i] != -1) {
+		buddy_prev[buddy_next[i]] = buddy_prev[i];
+	}
+	buddy_order[i] = -1;
+}
+
+// Frees the run of 2^k blocks at i, merging it with its buddy while that is free too
+static void buddy_free(int i, int k) {
+	while (k < BUDDY_ORDERS - 1) {
+		int buddy = i ^ (1 << k);
+		if (buddy_order[buddy] != k) {
+			break;
+		}
+		buddy_remove(buddy);
+		i &= ~(1 << k);
+		k++;
+	}
+	buddy_push(i, k);
+}
+
+// Frees blocks [start, start + len) as the largest aligned runs that cover them
+void buddy_free_range(int start, int len) {
+	while (len > 0) {
+		int k = 0;
+		while (k < BUDDY_ORDERS - 1 && (start & ((2 << k) - 1)) == 0 && (2 << k) <= len) {
+			k++;
+		}
+		buddy_free(start, k);
+		start += 1 << k;
+		len -= 1 << k;
+	}
+}
+
+// Takes up to count contiguous blocks, best fit: the smallest free run that holds
+// them is split down and its unused tail freed again. If no run is big enough the
+// largest one is taken. Returns the first block index and sets *got, or -1 when
+// no block is free. O(BUDDY_ORDERS), independent of the disk size.
+int buddy_alloc(int count, int *got) {
+	int want = 0;
+	while (want < BUDDY_ORDERS - 1 && (1 << want) < count) {
+		want++;
+	}
+	int k = want;
+	while (k < BUDDY_ORDERS && buddy_head[k] == -1) {
+		k++;
+	}
+	if (k == BUDDY_ORDERS) {
+		for (k = want; k >= 0 && buddy_head[k] == -1; k--) {
+		}
+		if (k < 0) {
+			return -1;
+		}
+		want = k;
+	}
+	int i = buddy_head[k];
+	buddy_remove(i);
+	while (k > want) {
+		k--;
+		buddy_push(i + (1 << k), k);
+	}
+	int n = count < (1 << k) ? count : 1 << k;
+	buddy_free_range(i + n, (1 << k) - n);
+	*got = n;
+	return i;
+}
+
+// Rebuilds the buddy index from the data block bitmap
+void buddy_init() {
+	for (int k = 0; k < BUDDY_ORDERS; k++) {
+		buddy_head[k] = -1;
+	}
+	memset(buddy_order, -1, sizeof(buddy_order));
+	int start = -1;
+	for (int i = 0; i <= superblock->max_dnum; i++) {
+		if (i < superblock->max_dnum && get_bitmap(data_block_bitmap, i) == 0) {
+			if (start == -1) {
+				start = i;
+			}
+		} else if (start != -1) {
+			buddy_free_range(start, i - start);
+			start = -1;
+		}
+	}
+}
+
+void buddy_stats(struct rufs_frag_stats *stats) {
+	memset(stats, 0, sizeof(struct rufs_frag_stats));
+	pthread_mutex_lock(&alloc_lock);
+	stats->free_blocks = superblock->free_blocks;
+	for (int k = 0; k < BUDDY_ORDERS; k++) {
+		for (int i = buddy_head[k]; i != -1; i = buddy_next[i]) {
+			stats->runs[k]++;
+		}
+		stats->free_runs += stats->runs[k];
+		if (stats->runs[k] > 0) {
+			stats->largest_run = 1 << k;
+		}
+	}
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * allocation magazines
+ */
+
+// Each allocating thread keeps a magazine of inode numbers and a run of data
+// blocks, taken from the bitmaps a batch at a time under alloc_lock. Allocations
+// come out of the thread's own magazine under its own lock, which other threads
+// only take to empty it, so parallel creates and writes don't contend.
+// Reserved entries are set in the in-memory bitmaps, so they are never handed out
+// twice, but only reach the disk as they are handed out, see inode_reserved.
+// They are counted apart so statfs still reports them free.
+struct magazine {
+	pthread_mutex_t lock;
+	int inos[INO_MAGAZINE];			/* highest first, taken from the end */
+	int ninos;
+	int blk_next;					/* reserved run of data blocks, bitmap indexes */
+	int blk_end;
+	struct magazine *next;
+};
+
+// Registered magazines, magazine_lock is taken before any magazine's lock
+struct magazine *magazines = NULL;
+pthread_mutex_t magazine_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t magazine_key;
+// Entries reserved in magazines, changed under alloc_lock or atomically
+int magazine_inos;
+int magazine_blocks;
+
+static void reserve_bit(unsigned char *reserved, int i) {
+	__atomic_fetch_or(&reserved[i / 8], 1 << (i & 7), __ATOMIC_RELEASE);
+}
+
+static void unreserve_bit(unsigned char *reserved, int i) {
+	__atomic_fetch_and(&reserved[i / 8], ~(1 << (i & 7)), __ATOMIC_RELEASE);
+}
+
+// Reserves up to count free inode numbers into mag, alloc_lock and its lock held
+static void magazine_fill_inos(struct magazine *mag, int count) {
+	int found[INO_MAGAZINE];
+	int n = 0;
+	for (int i = 0; i < superblock->max_inum && n < count; i++) {
+		if (get_bitmap(inode_bitmap, i) == 0) {
+			set_bitmap(inode_bitmap, i);
+			reserve_bit(inode_reserved, i);
+			found[n++] = i;
+		}
+	}
+	if (n == 0) {
+		return;
+	}
+	// lowest numbers are handed out first, as without magazines
+	for (int i = 0; i < n; i++) {
+		mag->inos[i] = found[n - 1 - i];
+	}
+	mag->ninos = n;
+	superblock->free_inodes -= n;
+	__atomic_add_fetch(&magazine_inos, n, __ATOMIC_RELAXED);
+	inode_bitmap_write();
+}
+
+// Reserves a run of up to count data blocks into mag, alloc_lock and its lock held
+static void magazine_fill_blocks(struct magazine *mag, int count) {
+	int got;
+	int start = buddy_alloc(count, &got);
+	if (start == -1) {
+		return;
+	}
+	for (int i = start; i < start + got; i++) {
+		set_bitmap(data_block_bitmap, i);
+		reserve_bit(data_block_reserved, i);
+	}
+	mag->blk_next = start;
+	mag->blk_end = start + got;
+	superblock->free_blocks -= got;
+	__atomic_add_fetch(&magazine_blocks, got, __ATOMIC_RELAXED);
+	data_block_bitmap_write();
+}
+
+// Returns what mag has reserved to the bitmaps, alloc_lock and its lock held
+static void magazine_empty(struct magazine *mag) {
+	if (mag->ninos > 0) {
+		for (int i = 0; i < mag->ninos; i++) {
+			unset_bitmap(inode_bitmap, mag->inos[i]);
+			unreserve_bit(inode_reserved, mag->inos[i]);
+		}
+		superblock->free_inodes += mag->ninos;
+		__atomic_sub_fetch(&magazine_inos, mag->ninos, __ATOMIC_RELAXED);
+		mag->ninos = 0;
+		inode_bitmap_write();
+	}
+	int nblocks = mag->blk_end - mag->blk_next;
+	if (nblocks > 0) {
+		for (int i = mag->blk_next; i < mag->blk_end; i++) {
+			unset_bitmap(data_block_bitmap, i);
+			unreserve_bit(data_block_reserved, i);
+		}
+		buddy_free_range(mag->blk_next, nblocks);
+		superblock->free_blocks += nblocks;
+		__atomic_sub_fetch(&magazine_blocks, nblocks, __ATOMIC_RELAXED);
+		mag->blk_next = mag->blk_end = 0;
+		data_block_bitmap_write();
+	}
+}
+
+// Key destructor: the thread is gone, its reservations go back to the bitmaps
+static void magazine_exit(void *arg) {
+	struct magazine *mag = arg;
+	pthread_mutex_lock(&magazine_lock);
+	struct magazine **link = &magazines;
+	while (*link != NULL && *link != mag) {
+		link = &(*link)->next;
+	}
+	if (*link == mag) {
+		*link = mag->next;
+	}
+	pthread_mutex_lock(&mag->lock);
+	pthread_mutex_lock(&alloc_lock);
+	magazine_empty(mag);
+	pthread_mutex_unlock(&alloc_lock);
+	pthread_mutex_unlock(&mag->lock);
+	pthread_mutex_unlock(&magazine_lock);
+	pthread_mutex_destroy(&mag->lock);
+	free(mag);
+}
+
+// Returns the calling thread's magazine, registering an empty one on first use
+static struct magazine* magazine_get() {
+	struct magazine *mag = pthread_getspecific(magazine_key);
+	if (mag != NULL) {
+		return mag;
+	}
+	mag = calloc(1, sizeof(struct magazine));
+	pthread_mutex_init(&mag->lock, NULL);
+	pthread_mutex_lock(&magazine_lock);
+	mag->next = magazines;
+	magazines = mag;
+	pthread_mutex_unlock(&magazine_lock);
+	pthread_setspecific(magazine_key, mag);
+	return mag;
+}
+
+// Returns every magazine's reservations to the bitmaps, when the bitmaps alone
+// have run dry and on unmount
+void magazine_empty_all() {
+	pthread_mutex_lock(&magazine_lock);
+	for (struct magazine *mag = magazines; mag != NULL; mag = mag->next) {
+		pthread_mutex_lock(&mag->lock);
+		pthread_mutex_lock(&alloc_lock);
+		magazine_empty(mag);
+		pthread_mutex_unlock(&alloc_lock);
+		pthread_mutex_unlock(&mag->lock);
+	}
+	pthread_mutex_unlock(&magazine_lock);
+}
+
+void magazine_start() {
+	pthread_key_create(&magazine_key, magazine_exit);
+}
+
+// Empties and frees every magazine, threads still running start over with new ones
+void magazine_stop() {
+	pthread_key_delete(magazine_key);
+	pthread_mutex_lock(&magazine_lock);
+	while (magazines != NULL) {
+		struct magazine *mag = magazines;
+		magazines = mag->next;
+		pthread_mutex_lock(&alloc_lock);
+		magazine_empty(mag);
+		pthread_mutex_unlock(&alloc_lock);
+		pthread_mutex_destroy(&mag->lock);
+		free(mag);
+	}
+	pthread_mutex_unlock(&magazine_lock);
+}
+
+/*
+ * deferred discards
+ */
+
+void batch_add(struct block_batch *batch, int blkno) {
+	if (batch->count == batch->capacity) {
+		batch->capacity = batch->capacity ? batch->capacity * 2 : 256;
+		batch->blocks = realloc(batch->blocks, sizeof(int) * batch->capacity);
+	}
+	batch->blocks[batch->count++] = blkno;
+}
+
+static int compare_int(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+// Returns the sorted blocks of batch to the bitmap and the buddy index, runs of
+// adjacent blocks a word at a time, with one bitmap write. alloc_lock held.
+static void batch_return(struct block_batch *batch) {
+	int run_start = 0;
+	for (int i = 1; i <= batch->count; i++) {
+		if (i < batch->count && batch->blocks[i] == batch->blocks[i - 1] + 1) {
+			continue;
+		}
+		unset_bitmap_range(data_block_bitmap, batch->blocks[run_start] - superblock->d_start_blk, i - run_start);
+		buddy_free_range(batch->blocks[run_start] - superblock->d_start_blk, i - run_start);
+		run_start = i;
+	}
+	superblock->free_blocks += batch->count;
+	data_block_bitmap_write();
+}
+
+// Holds n freed blocks for a later discard pass, alloc_lock held. Their bits
+// stay set, so nobody reuses them before they are punched.
+static void discard_defer(const int *blocks, int n) {
+	pthread_mutex_lock(&discard_lock);
+	for (int i = 0; i < n; i++) {
+		reserve_bit(data_block_reserved, blocks[i] - superblock->d_start_blk);
+		batch_add(&discard_queue, blocks[i]);
+	}
+	pthread_mutex_unlock(&discard_lock);
+	discard_blocks += n;
+	data_block_bitmap_write();
+	// the reclaimer may be asleep with nothing to wait for
+	pthread_mutex_lock(&reclaim_lock);
+	pthread_cond_signal(&reclaim_cond);
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+// Returns the blocks of batch, taken off the discard lists, to the allocator
+static void discard_return(struct block_batch *batch) {
+	qsort(batch->blocks, batch->count, sizeof(int), compare_int);
+	pthread_mutex_lock(&alloc_lock);
+	for (int i = 0; i < batch->count; i++) {
+		unreserve_bit(data_block_reserved, batch->blocks[i] - superblock->d_start_blk);
+	}
+	discard_blocks -= batch->count;
+	batch_return(batch);
+	pthread_mutex_unlock(&alloc_lock);
+	free(batch->blocks);
+}
+
+// Hands every block waiting for its discard back unpunched, when allocation
+// has nothing else left. Reusing a block is safe, only punching it early isn't.
+// Blocks a running pass took are waited for, it returns them once punched.
+void discard_cancel() {
+	pthread_mutex_lock(&discard_lock);
+	while (discard_running) {
+		pthread_cond_wait(&discard_cond, &discard_lock);
+	}
+	struct block_batch batch = discard_queue;
+	for (int i = 0; i < discard_aged.count; i++) {
+		batch_add(&batch, discard_aged.blocks[i]);
+	}
+	free(discard_aged.blocks);
+	discard_queue = (struct block_batch){ NULL, 0, 0 };
+	discard_aged = (struct block_batch){ NULL, 0, 0 };
+	pthread_mutex_unlock(&discard_lock);
+	discard_return(&batch);
+}
+
+// Writes back every dirty block and syncs the device, then punches the blocks
+// freed before the previous pass: that one or this one has written whatever
+// stopped mapping them. Blocks freed since then wait for the next pass, or are
+// punched too with all, once nothing changes any more at unmount.
+void discard_pass(int all) {
+	pthread_mutex_lock(&discard_lock);
+	struct block_batch batch = discard_aged;
+	discard_aged = discard_queue;
+	discard_queue = (struct block_batch){ NULL, 0, 0 };
+	if (all) {
+		for (int i = 0; i < discard_aged.count; i++) {
+			batch_add(&batch, discard_aged.blocks[i]);
+		}
+		free(discard_aged.blocks);
+		discard_aged = (struct block_batch){ NULL, 0, 0 };
+	}
+	discard_last_ms = now_ms();
+	discard_running = 1;
+	pthread_mutex_unlock(&discard_lock);
+
+	cache_flush(1);
+	if (dev_sync() != 0) {
+		// the holes would not be safe yet, try again next pass
+		pthread_mutex_lock(&discard_lock);
+		for (int i = 0; i < batch.count; i++) {
+			batch_add(&discard_aged, batch.blocks[i]);
+		}
+		free(batch.blocks);
+	} else {
+		qsort(batch.blocks, batch.count, sizeof(int), compare_int);
+		int run_start = 0;
+		for (int i = 1; i <= batch.count; i++) {
+			if (i < batch.count && batch.blocks[i] == batch.blocks[i - 1] + 1) {
+				continue;
+			}
+			dev_discard(batch.blocks[run_start], i - run_start);
+			run_start = i;
+		}
+		discard_return(&batch);
+		pthread_mutex_lock(&discard_lock);
+	}
+	discard_running = 0;
+	pthread_cond_broadcast(&discard_cond);
+	pthread_mutex_unlock(&discard_lock);
+}
+
+int get_avail_ino() {
+	// Step 1: Take the next inode number from this thread's magazine
+	struct magazine *mag = magazine_get();
+	pthread_mutex_lock(&mag->lock);
+	// Step 2: Refill it from the inode bitmap, cached in memory, when it is empty
+	if (mag->ninos == 0) {
+		pthread_mutex_lock(&alloc_lock);
+		magazine_fill_inos(mag, INO_MAGAZINE);
+		pthread_mutex_unlock(&alloc_lock);
+	}
+	if (mag->ninos == 0) {
+		// Step 3: Other magazines may hold the last free inodes
+		pthread_mutex_unlock(&mag->lock);
+		magazine_empty_all();
+		pthread_mutex_lock(&mag->lock);
+		pthread_mutex_lock(&alloc_lock);
+		magazine_fill_inos(mag, 1);
+		pthread_mutex_unlock(&alloc_lock);
+	}
+	int available_slot = -1;
+	if (mag->ninos > 0) {
+		available_slot = mag->inos[--mag->ninos];
+		__atomic_sub_fetch(&magazine_inos, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&mag->lock);
+	if (available_slot == -1) {
+		printf("No available inodes.\n");
+		return -1;
+	}
+	// in use from here on, so the bitmap on disk may show it
+	unreserve_bit(inode_reserved, available_slot);
+	cache_set_bit(superblock->i_bitmap_blk, available_slot);
+	return available_slot;
+}
+
+/* 
+ * Return an inode number that was never written to the inode bitmap
+ */
+void free_ino(int ino) {
+	pthread_mutex_lock(&alloc_lock);
+	unset_bitmap(inode_bitmap, ino);
+	superblock->free_inodes++;
+	inode_bitmap_write();
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+// Waits, when allocation has nothing else left, until the reclaimer has freed
+// some of the blocks it holds for their grace period. Returns 0 if it held none.
+int reclaim_wait_held() {
+	pthread_mutex_lock(&reclaim_lock);
+	int held = reclaim_held;
+	if (held > 0) {
+		// they are due within SPLICE_GRACE_MS, don't wait on a stopped reclaimer past that
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += 2 * SPLICE_GRACE_MS / 1000;
+		while (reclaim_held >= held) {
+			if (pthread_cond_timedwait(&reclaim_done_cond, &reclaim_lock, &deadline) == ETIMEDOUT) {
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+	return held > 0;
+}
+
+/* 
+ * Get available data block number from bitmap
+ */
+int get_avail_blkno() {
+	// Step 1: Take the next block of this thread's reserved run, so a thread
+	// writing a file gets contiguous blocks whatever other threads allocate
+	struct magazine *mag = magazine_get();
+	pthread_mutex_lock(&mag->lock);
+	// Step 2: Reserve a new run from the buddy index when it is used up
+	if (mag->blk_next == mag->blk_end) {
+		pthread_mutex_lock(&alloc_lock);
+		magazine_fill_blocks(mag, BLK_MAGAZINE);
+		pthread_mutex_unlock(&alloc_lock);
+	}
+	if (mag->blk_next == mag->blk_end) {
+		// Step 3: Other magazines may hold the last free blocks
+		pthread_mutex_unlock(&mag->lock);
+		magazine_empty_all();
+		pthread_mutex_lock(&mag->lock);
+		pthread_mutex_lock(&alloc_lock);
+		magazine_fill_blocks(mag, 1);
+		pthread_mutex_unlock(&alloc_lock);
+	}
+	if (mag->blk_next == mag->blk_end && __atomic_load_n(&reclaim_held, __ATOMIC_RELAXED) > 0) {
+		// Step 4: Blocks files stopped mapping are free once their grace period is over
+		pthread_mutex_unlock(&mag->lock);
+		reclaim_wait_held();
+		pthread_mutex_lock(&mag->lock);
+		pthread_mutex_lock(&alloc_lock);
+		magazine_fill_blocks(mag, 1);
+		pthread_mutex_unlock(&alloc_lock);
+	}
+	if (mag->blk_next == mag->blk_end && __atomic_load_n(&discard_blocks, __ATOMIC_RELAXED) > 0) {
+		// Step 5: So may the blocks waiting for their discard
+		pthread_mutex_unlock(&mag->lock);
+		discard_cancel();
+		pthread_mutex_lock(&mag->lock);
+		pthread_mutex_lock(&alloc_lock);
+		magazine_fill_blocks(mag, 1);
+		pthread_mutex_unlock(&alloc_lock);
+	}
+	int available_slot = -1;
+	if (mag->blk_next < mag->blk_end) {
+		available_slot = mag->blk_next++;
+		__atomic_sub_fetch(&magazine_blocks, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&mag->lock);
+	if (available_slot == -1) {
+		printf("No available data blocks.\n");
+		return -1;
+	}
+	unreserve_bit(data_block_reserved, available_slot);
+	cache_set_bit(superblock->d_bitmap_blk, available_slot);
+	// bitmap bit i tracks disk block d_start_blk + i
+	return superblock->d_start_blk + available_slot;
+}
+
+/* 
+ * Get a run of up to count contiguous data blocks, best fit from the buddy
+ * index, with one bitmap write. Takes the largest free run if none is long enough.
+ */
+int get_avail_blkno_run(int count, int *run_len) {
+	pthread_mutex_lock(&alloc_lock);
+	int best_len = 0;
+	int best_start = buddy_alloc(count, &best_len);
+	if (best_start == -1 && __atomic_load_n(&reclaim_held, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_unlock(&alloc_lock);
+		reclaim_wait_held();
+		pthread_mutex_lock(&alloc_lock);
+		best_start = buddy_alloc(count, &best_len);
+	}
+	if (best_start == -1 && discard_blocks > 0) {
+		// blocks waiting for their discard are reused instead
+		pthread_mutex_unlock(&alloc_lock);
+		discard_cancel();
+		pthread_mutex_lock(&alloc_lock);
+		best_start = buddy_alloc(count, &best_len);
+	}
+	*run_len = best_len;
+	if (best_start == -1) {
+		printf("No available data blocks.\n");
+		pthread_mutex_unlock(&alloc_lock);
+		return -1;
+	}
+	for (int i = best_start; i < best_start + best_len; i++) {
+		set_bitmap(data_block_bitmap, i);
+	}
+	superblock->free_blocks -= best_len;
+	data_block_bitmap_write();
+	pthread_mutex_unlock(&alloc_lock);
+	return superblock->d_start_blk + best_start;
+}
+
+// Writes the reference count block holding data block index i to the cache
+static void block_refs_write(int i) {
+	int per_block = BLOCK_SIZE / sizeof(uint16_t);
+	cache_write(superblock->r_start_blk + i / per_block, block_refs + i / per_block * per_block);
+}
+
+// Returns whether data block blkno is mapped by more than one file
+int block_is_shared(int blkno) {
+	pthread_mutex_lock(&alloc_lock);
+	int shared = block_refs[blkno - superblock->d_start_blk] > 0;
+	pthread_mutex_unlock(&alloc_lock);
+	return shared;
+}
+
+// Adds a reference to data block blkno. Returns -1 if its count is saturated.
+int block_ref(int blkno) {
+	int i = blkno - superblock->d_start_blk;
+	pthread_mutex_lock(&alloc_lock);
+	if (block_refs[i] == UINT16_MAX) {
+		pthread_mutex_unlock(&alloc_lock);
+		return -1;
+	}
+	block_refs[i]++;
+	block_refs_write(i);
+	pthread_mutex_unlock(&alloc_lock);
+	return 0;
+}
+
+// Drops one reference to data block blkno, with alloc_lock held. Returns 0 if it
+// was the only one, then the caller frees the block.
+static int block_unref(int blkno) {
+	int i = blkno - superblock->d_start_blk;
+	if (block_refs[i] == 0) {
+		return 0;
+	}
+	block_refs[i]--;
+	block_refs_write(i);
+	return 1;
+}
+
+/* 
+ * Return a data block to the data block bitmap
+ */
+void free_blkno(int blkno) {
+	pthread_mutex_lock(&alloc_lock);
+	int shared = block_unref(blkno);
+	pthread_mutex_unlock(&alloc_lock);
+	if (shared) { // another file still maps it
+		return;
+	}
+	cache_drop(blkno);
+	pthread_mutex_lock(&alloc_lock);
+	if (options.discard) {
+		discard_defer(&blkno, 1);
+	} else {
+		unset_bitmap(data_block_bitmap, blkno - superblock->d_start_blk);
+		buddy_free(blkno - superblock->d_start_blk, 0);
+		superblock->free_blocks++;
+		data_block_bitmap_write();
+	}
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/* 
+ * Return every block of a batch to the data block bitmap: runs of adjacent
+ * blocks are cleared a word at a time, and the bitmap is written back once.
+ * With discard on they wait for a discard pass instead.
+ */
+void batch_commit(struct block_batch *batch) {
+	if (batch->count == 0) {
+		return;
+	}
+	qsort(batch->blocks, batch->count, sizeof(int), compare_int);
+	// blocks other files still share only lose a reference
+	pthread_mutex_lock(&alloc_lock);
+	int kept = 0;
+	for (int i = 0; i < batch->count; i++) {
+		if (!block_unref(batch->blocks[i])) {
+			batch->blocks[kept++] = batch->blocks[i];
+		}
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	batch->count = kept;
+	if (batch->count == 0) {
+		return;
+	}
+	// freed contents no longer matter, don't let the flusher write them back
+	for (int i = 0; i < batch->count; i++) {
+		cache_drop(batch->blocks[i]);
+	}
+	pthread_mutex_lock(&alloc_lock);
+	if (options.discard) {
+		discard_defer(batch->blocks, batch->count);
+	} else {
+		batch_return(batch);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	batch->count = 0;
+}
+
+void batch_release(struct block_batch *batch) {
+	batch_commit(batch);
+	free(batch->blocks);
+	batch->blocks = NULL;
+	batch->capacity = 0;
+}
+
+/* 
+ * Return a batch of inode numbers to the inode bitmap with one bitmap write
+ */
+void ino_batch_commit(struct block_batch *batch) {
+	if (batch->count == 0) {
+		return;
+	}
+	pthread_mutex_lock(&alloc_lock);
+	for (int i = 0; i < batch->count; i++) {
+		unset_bitmap(inode_bitmap, batch->blocks[i]);
+	}
+	superblock->free_inodes += batch->count;
+	inode_bitmap_write();
+	pthread_mutex_unlock(&alloc_lock);
+	batch->count = 0;
+}
+
+/* 
+ * inode operations
+ */
+
+// Reads corresponding on-disk inode to an in-memory inode
+int readi(uint16_t ino, struct inode *inode) {
+  // Step 1: Get the inode's on-disk block number
+	int block_no = calc_inode_block_no(ino);
+  // Step 2: Get offset of the inode in the inode on-disk block
+	int offset = calc_inode_offset(ino);
+  // Step 3: Read the block from disk and then copy into inode structure
+	char block[BLOCK_SIZE];
+	pthread_mutex_lock(&itable_lock);
+	if (!itable_ready(block_no)) {
+		// never written since mkfs, so it only holds free inodes
+		pthread_mutex_unlock(&itable_lock);
+		memset(inode, 0, sizeof(struct inode));
+		return 0;
+	}
+	cache_read(block_no, block);
+	pthread_mutex_unlock(&itable_lock);
+	memcpy(inode, block + offset, sizeof(struct inode));
+	times_merge(ino, inode, 0);
+
+	return 0;
+}
+
+// Writes the in-memory inode to the disk inode
+int writei(uint16_t ino, struct inode *inode) {
+	// Step 1: Get the block number where this inode resides on disk
+	int block_no = calc_inode_block_no(ino);
+	// Step 2: Get the offset in the block where this inode resides on disk
+	int offset = calc_inode_offset(ino);
+	// Step 3: Write inode to disk 
+	char block[BLOCK_SIZE];
+	pthread_mutex_lock(&itable_lock);
+	itable_init_upto(block_no);
+	cache_read(block_no, block);
+	times_merge(ino, inode, 1);
+	memcpy(block + offset, inode, sizeof(struct inode));
+	cache_write(block_no, block);
+	pthread_mutex_unlock(&itable_lock);
+
+	return 0;
+}
+
+/*
+ * block map cache
+ */
+
+static int bmap_hash(int ino, int lblk) {
+	unsigned int h = (unsigned int)ino * 2654435761u ^ (unsigned int)lblk * 40503u;
+	return h & (BMAP_CACHE_SIZE - 1);
+}
+
+void bmap_cache_init() {
+	for (int i = 0; i < BMAP_CACHE_SIZE; i++) {
+		bmap_cache[i].ino = -1;
+	}
+}
+
+// Returns the cached physical block for (ino, lblk), or -1 on a miss
+int bmap_cache_lookup(int ino, int lblk) {
+	int pblk = -1;
+	pthread_mutex_lock(&bmap_lock);
+	struct bmap_entry *entry = &bmap_cache[bmap_hash(ino, lblk)];
+	if (entry->ino == ino && entry->lblk == lblk) {
+		pblk = entry->pblk;
+	}
+	pthread_mutex_unlock(&bmap_lock);
+	return pblk;
+}
+
+void bmap_cache_insert(int ino, int lblk, int pblk) {
+	pthread_mutex_lock(&bmap_lock);
+	struct bmap_entry *entry = &bmap_cache[bmap_hash(ino, lblk)];
+	entry->ino = ino;
+	entry->lblk = lblk;
+	entry->pblk = pblk;
+	pthread_mutex_unlock(&bmap_lock);
+}
+
+// Drops every cached translation of ino, must be called before its blocks are freed
+void bmap_cache_invalidate(int ino) {
+	pthread_mutex_lock(&bmap_lock);
+	for (int i = 0; i < BMAP_CACHE_SIZE; i++) {
+		if (bmap_cache[i].ino == ino) {
+			bmap_cache[i].ino = -1;
+		}
+	}
+	pthread_mutex_unlock(&bmap_lock);
+}
+
+/*
+ * decompressed cluster cache
+ */
+
+void zcache_init() {
+	for (int i = 0; i < ZCACHE_CLUSTERS; i++) {
+		zcache[i].ino = -1;
+		zcache[i].data = malloc(CLUSTER_SIZE);
+	}
+}
+
+void zcache_destroy() {
+	for (int i = 0; i < ZCACHE_CLUSTERS; i++) {
+		free(zcache[i].data);
+		zcache[i].data = NULL;
+		zcache[i].ino = -1;
+	}
+}
+
+// Drops every cached cluster of file ino
+void zcache_invalidate(int ino) {
+	pthread_mutex_lock(&zcache_lock);
+	for (int i = 0; i < ZCACHE_CLUSTERS; i++) {
+		if (zcache[i].ino == ino) {
+			zcache[i].ino = -1;
+		}
+	}
+	pthread_mutex_unlock(&zcache_lock);
+}
+
+// Copies len bytes at offset of a cached cluster to buf, returns -1 if it is not cached
+static int zcache_lookup(int ino, int cluster, int offset, int len, void *buf) {
+	pthread_mutex_lock(&zcache_lock);
+	for (int i = 0; i < ZCACHE_CLUSTERS; i++) {
+		if (zcache[i].ino == ino && zcache[i].cluster == cluster) {
+			memcpy(buf, zcache[i].data + offset, len);
+			zcache[i].used = ++zcache_clock;
+			pthread_mutex_unlock(&zcache_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&zcache_lock);
+	return -1;
+}
+
+// Caches a decompressed cluster in place of the least recently used one
+static void zcache_insert(int ino, int cluster, const char *data) {
+	pthread_mutex_lock(&zcache_lock);
+	struct zcache_entry *victim = &zcache[0];
+	for (int i = 0; i < ZCACHE_CLUSTERS; i++) {
+		if (zcache[i].ino == ino && zcache[i].cluster == cluster) {
+			victim = &zcache[i];
+			break;
+		}
+		if (zcache[i].ino == -1 || zcache[i].used < victim->used) {
+			victim = &zcache[i];
+		}
+	}
+	victim->ino = ino;
+	victim->cluster = cluster;
+	victim->used = ++zcache_clock;
+	memcpy(victim->data, data, CLUSTER_SIZE);
+	pthread_mutex_unlock(&zcache_lock);
+}
+
+// Leaves cluster c of file ino plain until the file is released, unless the
+// table is full
+static void recompress_defer(int ino, int cluster) {
+	pthread_mutex_lock(&recompress_lock);
+	int found = 0;
+	for (int i = 0; i < nrecompress && !found; i++) {
+		found = recompress[i].ino == ino && recompress[i].cluster == cluster;
+	}
+	if (!found && nrecompress < RECOMPRESS_SLOTS) {
+		recompress[nrecompress++] = (struct recompress_entry){ ino, cluster };
+	}
+	pthread_mutex_unlock(&recompress_lock);
+}
+
+// Returns 1 if cluster c of file ino waits for its release to be compressed
+static int recompress_pending(int ino, int cluster) {
+	int found = 0;
+	pthread_mutex_lock(&recompress_lock);
+	for (int i = 0; i < nrecompress && !found; i++) {
+		found = recompress[i].ino == ino && recompress[i].cluster == cluster;
+	}
+	pthread_mutex_unlock(&recompress_lock);
+	return found;
+}
+
+// Removes the deferred clusters of file ino from the table, copying them to
+// clusters (RECOMPRESS_SLOTS entries) unless it is NULL. Returns how many there were.
+int recompress_take(int ino, int *clusters) {
+	int n = 0;
+	pthread_mutex_lock(&recompress_lock);
+	for (int i = 0; i < nrecompress; ) {
+		if (recompress[i].ino != ino) {
+			i++;
+			continue;
+		}
+		if (clusters != NULL) {
+			clusters[n] = recompress[i].cluster;
+		}
+		n++;
+		recompress[i] = recompress[--nrecompress];
+	}
+	pthread_mutex_unlock(&recompress_lock);
+	return n;
+}
+
+/*
+ * background reclamation
+ */
+
+// Adds every block of the tree under ptr, the pointer blocks included, to batch
+static void reclaim_tree(int ptr, int levels, struct block_batch *batch) {
+	int ptrs[PTRS_PER_BLOCK];
+	cache_read(ptr, ptrs);
+	for (int idx = 0; idx < PTRS_PER_BLOCK; idx++) {
+		if (ptrs[idx] == -1) {
+			continue;
+		}
+		if (levels == 1) {
+			batch_add(batch, PTR_BLKNO(ptrs[idx]));
+		} else {
+			reclaim_tree(ptrs[idx], levels - 1, batch);
+		}
+	}
+	batch_add(batch, ptr);
+}
+
+// Invalidates an unlinked inode on disk and adds all of its blocks to batch
+static void reclaim_inode(int ino, struct block_batch *batch) {
+	struct inode inode;
+	pthread_rwlock_wrlock(&remap_lock[ino]);
+	readi(ino, &inode);
+	bmap_cache_invalidate(ino);
+	zcache_invalidate(ino);
+	recompress_take(ino, NULL);
+	for (int i = 0; i < DIRECT_PTRS; i++) {
+		if (inode.direct_ptr[i] != -1) {
+			batch_add(batch, PTR_BLKNO(inode.direct_ptr[i]));
+		}
+	}
+	for (int slot = 0; slot < INDIRECT_PTRS; slot++) {
+		if (inode.indirect_ptr[slot] == -1) {
+			continue;
+		}
+		int levels = 1;
+		if (slot == DOUBLE_INDIRECT_SLOT) {
+			levels = 2;
+		} else if (slot == TRIPLE_INDIRECT_SLOT) {
+			levels = 3;
+		}
+		reclaim_tree(inode.indirect_ptr[slot], levels, batch);
+	}
+	memset(&inode, 0, sizeof(struct inode));
+	inode.ino = ino;
+	times_drop(ino);
+	writei(ino, &inode);
+	pthread_rwlock_unlock(&remap_lock[ino]);
+}
+
+// Frees queued trees and inodes, committing to the bitmaps once per batch of jobs.
+// Blocks whose grace period hasn't run out wait in a list of their own. Also runs
+// the discard passes, which the flusher can't: writers throttled on it may hold
+// alloc_lock.
+static void* reclaimer(void *arg) {
+	struct block_batch batch = { NULL, 0, 0 };
+	struct block_batch inodes = { NULL, 0, 0 };
+	struct reclaim_job *waiting = NULL;
+	uint64_t wake_ms = 0;			/* earliest due_ms in waiting */
+	pthread_mutex_lock(&reclaim_lock);
+	while (1) {
+		while (reclaim_queue == NULL && !reclaim_stop) {
+			uint64_t wake = waiting != NULL ? wake_ms : UINT64_MAX;
+			if (__atomic_load_n(&discard_blocks, __ATOMIC_RELAXED) > 0
+					&& discard_last_ms + options.dirty_expire_ms < wake) {
+				wake = discard_last_ms + options.dirty_expire_ms;
+			}
+			if (wake == UINT64_MAX) {
+				pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+				continue;
+			}
+			uint64_t now = now_ms();
+			if (now >= wake) {
+				break;
+			}
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += (wake - now) / 1000;
+			deadline.tv_nsec += (long)((wake - now) % 1000) * 1000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&reclaim_cond, &reclaim_lock, &deadline);
+		}
+		if (reclaim_queue == NULL && waiting == NULL && reclaim_stop) { // stopping and drained
+			break;
+		}
+		// at unmount nothing can be reading any more, grace periods end early
+		int stopping = reclaim_stop;
+		struct reclaim_job *job = reclaim_queue;
+		reclaim_queue = NULL;
+		pthread_mutex_unlock(&reclaim_lock);
+
+		if (waiting != NULL) {
+			struct reclaim_job *last = waiting;
+			while (last->next != NULL) {
+				last = last->next;
+			}
+			last->next = job;
+			job = waiting;
+			waiting = NULL;
+		}
+		uint64_t now = now_ms();
+		int released = 0;			/* held jobs freed by this pass */
+		while (job != NULL) {
+			struct reclaim_job *next = job->next;
+			if (job->due_ms > now && !stopping) {
+				if (waiting == NULL || job->due_ms < wake_ms) {
+					wake_ms = job->due_ms;
+				}
+				job->next = waiting;
+				waiting = job;
+				job = next;
+				continue;
+			}
+			if (job->due_ms != 0) {
+				released++;
+			}
+			if (job->blocks != NULL) {
+				for (int i = 0; i < job->count; i++) {
+					batch_add(&batch, job->blocks[i]);
+				}
+				free(job->blocks);
+			} else if (job->ino != -1) {
+				reclaim_inode(job->ino, &batch);
+				batch_add(&inodes, job->ino);
+			} else {
+				reclaim_tree(job->ptr, job->levels, &batch);
+			}
+			free(job);
+			job = next;
+		}
+		// blocks first, so an inode number is never reused while its blocks are still held
+		batch_commit(&batch);
+		ino_batch_commit(&inodes);
+		// at unmount rufs_destroy() punches what is left
+		if (!stopping && __atomic_load_n(&discard_blocks, __ATOMIC_RELAXED) > 0
+				&& now_ms() >= discard_last_ms + options.dirty_expire_ms) {
+			discard_pass(0);
+		}
+
+		pthread_mutex_lock(&reclaim_lock);
+		if (released > 0) {
+			reclaim_held -= released;
+			pthread_cond_broadcast(&reclaim_done_cond);
+		}
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+	batch_release(&batch);
+	free(inodes.blocks);
+	return NULL;
+}
+
+static void reclaim_push(struct reclaim_job *job) {
+	pthread_mutex_lock(&reclaim_lock);
+	job->next = reclaim_queue;
+	reclaim_queue = job;
+	pthread_cond_signal(&reclaim_cond);
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+// Adds a pointer tree taken out of a block map to the list detached
+void reclaim_detach(struct reclaim_job **detached, int ptr, int levels) {
+	struct reclaim_job *job = malloc(sizeof(struct reclaim_job));
+	job->ptr = ptr;
+	job->levels = levels;
+	job->ino = -1;
+	job->blocks = NULL;
+	job->due_ms = 0;
+	job->next = *detached;
+	*detached = job;
+}
+
+// Returns when data blocks a file stops mapping now may be freed, 0 if right away
+static uint64_t reclaim_due_ms() {
+	off_t dev_pos;
+	if (dev_block_fd(superblock->d_start_blk, &dev_pos) < 0) {
+		return 0; // no fd, so no read was spliced
+	}
+	return now_ms() + SPLICE_GRACE_MS;
+}
+
+// Queues the trees a bmap_unmap() detached for freeing. Only called once the inode
+// that pointed at them has been written, until then readers may still follow them.
+void reclaim_enqueue_detached(struct reclaim_job *detached) {
+	if (detached == NULL) {
+		return;
+	}
+	uint64_t due_ms = reclaim_due_ms();
+	int count = 1;
+	struct reclaim_job *last = detached;
+	last->due_ms = due_ms;
+	while (last->next != NULL) {
+		last = last->next;
+		last->due_ms = due_ms;
+		count++;
+	}
+	pthread_mutex_lock(&reclaim_lock);
+	if (due_ms != 0) {
+		reclaim_held += count;
+	}
+	last->next = reclaim_queue;
+	reclaim_queue = detached;
+	pthread_cond_signal(&reclaim_cond);
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+// Queues an inode that no directory entry references any more for freeing
+void reclaim_enqueue_inode(int ino) {
+	struct reclaim_job *job = malloc(sizeof(struct reclaim_job));
+	job->ptr = -1;
+	job->levels = 0;
+	job->ino = ino;
+	job->blocks = NULL;
+	job->due_ms = 0;
+	reclaim_push(job);
+}
+
+// Frees the blocks of batch, which a file stopped mapping, and empties it. While
+// spliced reads may still copy from them they go to the reclaimer instead, which
+// frees them once SPLICE_GRACE_MS have passed.
+void batch_release_unmapped(struct block_batch *batch) {
+	uint64_t due_ms = batch->count > 0 ? reclaim_due_ms() : 0;
+	if (due_ms == 0) {
+		batch_release(batch);
+		return;
+	}
+	struct reclaim_job *job = malloc(sizeof(struct reclaim_job));
+	job->ptr = -1;
+	job->levels = 0;
+	job->ino = -1;
+	job->blocks = batch->blocks;
+	job->count = batch->count;
+	job->due_ms = due_ms;
+	pthread_mutex_lock(&reclaim_lock);
+	reclaim_held++;
+	pthread_mutex_unlock(&reclaim_lock);
+	reclaim_push(job);
+	batch->blocks = NULL;
+	batch->count = 0;
+	batch->capacity = 0;
+}
+
+// Takes a handle on inode ino for fi->fh
+void inode_open(int ino) {
+	pthread_mutex_lock(&open_lock);
+	open_count[ino]++;
+	pthread_mutex_unlock(&open_lock);
+}
+
+// Drops a handle, reclaiming the inode if it was the last one of an orphan
+void inode_release(int ino) {
+	pthread_mutex_lock(&open_lock);
+	int reclaim = --open_count[ino] == 0 && orphan[ino];
+	if (reclaim) {
+		orphan[ino] = 0;
+	}
+	pthread_mutex_unlock(&open_lock);
+	if (reclaim) {
+		reclaim_enqueue_inode(ino);
+	}
+}
+
+// Reclaims an inode no directory entry references any more, once nothing has it open
+void inode_unlinked(int ino) {
+	pthread_mutex_lock(&open_lock);
+	int reclaim = open_count[ino] == 0;
+	if (!reclaim) {
+		orphan[ino] = 1;
+	}
+	pthread_mutex_unlock(&open_lock);
+	if (reclaim) {
+		reclaim_enqueue_inode(ino);
+	}
+}
+
+// Reclaims the orphans left open at unmount
+void orphans_reclaim() {
+	pthread_mutex_lock(&open_lock);
+	for (int ino = 0; ino < MAX_INUM; ino++) {
+		if (orphan[ino]) {
+			orphan[ino] = 0;
+			open_count[ino] = 0;
+			reclaim_enqueue_inode(ino);
+		}
+	}
+	pthread_mutex_unlock(&open_lock);
+}
+
+void reclaim_start() {
+	reclaim_stop = 0;
+	pthread_create(&reclaim_thread, NULL, reclaimer, NULL);
+}
+
+// Stops the reclaimer once everything queued so far has been freed
+void reclaim_finish() {
+	pthread_mutex_lock(&reclaim_lock);
+	reclaim_stop = 1;
+	pthread_cond_signal(&reclaim_cond);
+	pthread_mutex_unlock(&reclaim_lock);
+	pthread_join(reclaim_thread, NULL);
+}
+
+/*
+ * block map operations
+ */
+
+// Resolves a leaf pointer: with set_to it is overwritten, otherwise a missing
+// block is allocated when new_block is set
+static int bmap_leaf(struct inode *inode, int *entry, int *new_block, int set_to) {
+	if (set_to != BMAP_LOOKUP) {
+		if (*entry == -1 && set_to != -1) {
+			inode->vstat.st_blocks += BLOCK_SIZE / 512;
+		}
+		*entry = set_to;
+	} else if (*entry == -1 && new_block != NULL) {
+		int blkno = get_avail_blkno();
+		if (blkno != -1) {
+			*entry = blkno;
+			*new_block = 1;
+			inode->vstat.st_blocks += BLOCK_SIZE / 512;
+		}
+	}
+	return *entry;
+}
+
+// Walks `levels` levels of pointer blocks starting at *ptr to find entry rel.
+// Missing pointer blocks and the data block itself are allocated when new_block is set.
+static int bmap_indirect(struct inode *inode, int *ptr, int rel, int levels, int *new_block, int set_to) {
+	int ptrs[PTRS_PER_BLOCK];
+	int fresh = 0;
+	if (*ptr == -1) {
+		if (new_block == NULL) {
+			return -1;
+		}
+		int blkno = get_avail_blkno();
+		if (blkno == -1) {
+			return -1;
+		}
+		// a fresh pointer block has every entry unmapped
+		memset(ptrs, 0xff, BLOCK_SIZE);
+		cache_write_ino(blkno, ptrs, inode->ino);
+		*ptr = blkno;
+		inode->vstat.st_blocks += BLOCK_SIZE / 512;
+		fresh = 1;
+	} else {
+		cache_read(*ptr, ptrs);
+	}
+
+	int span = 1;
+	for (int l = 1; l < levels; l++) {
+		span *= PTRS_PER_BLOCK;
+	}
+	int idx = rel / span;
+	int child = ptrs[idx];
+	int pblk;
+	if (levels == 1) {
+		pblk = bmap_leaf(inode, &child, new_block, set_to);
+	} else {
+		pblk = bmap_indirect(inode, &child, rel % span, levels - 1, new_block, set_to);
+	}
+	if (fresh && child == -1) {
+		// nothing below got mapped, e.g. the data block could not be allocated:
+		// the new pointer block would only hold unmapped entries
+		free_blkno(*ptr);
+		*ptr = -1;
+		inode->vstat.st_blocks -= BLOCK_SIZE / 512;
+		return pblk;
+	}
+	if (child != ptrs[idx]) {
+		ptrs[idx] = child;
+		cache_write_ino(*ptr, ptrs, inode->ino);
+	}
+	return pblk;
+}
+
+static int bmap_map(struct inode *inode, int lblk, int *new_block, int set_to) {
+	if (lblk < 0) {
+		return -1;
+	}
+	int pblk;
+	if (set_to == BMAP_LOOKUP) {
+		pblk = bmap_cache_lookup(inode->ino, lblk);
+		if (pblk != -1) {
+			return pblk;
+		}
+	}
+
+	if (lblk < DIRECT_PTRS) {
+		pblk = bmap_leaf(inode, &inode->direct_ptr[lblk], new_block, set_to);
+	} else {
+		int rel = lblk - DIRECT_PTRS;
+		int single_span = SINGLE_INDIRECT_PTRS * PTRS_PER_BLOCK;
+		int double_span = PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+		if (rel < single_span) {
+			pblk = bmap_indirect(inode, &inode->indirect_ptr[rel / PTRS_PER_BLOCK], rel % PTRS_PER_BLOCK, 1, new_block, set_to);
+		} else if ((rel -= single_span) < double_span) {
+			pblk = bmap_indirect(inode, &inode->indirect_ptr[DOUBLE_INDIRECT_SLOT], rel, 2, new_block, set_to);
+		} else if ((rel -= double_span) < double_span * PTRS_PER_BLOCK) {
+			pblk = bmap_indirect(inode, &inode->indirect_ptr[TRIPLE_INDIRECT_SLOT], rel, 3, new_block, set_to);
+		} else {
+			return -1;
+		}
+	}
+
+	if (pblk != -1) {
+		bmap_cache_insert(inode->ino, lblk, pblk);
+	}
+	return pblk;
+}
+
+// Translates logical block lblk of inode to a block pointer, or -1 if it is unmapped.
+// The pointer may carry UNWRITTEN_FLAG, use PTR_BLKNO() for the disk block number.
+// With new_block set, missing blocks are allocated (updating inode, which the caller
+// writes back) and *new_block is set to 1 if the data block itself is new.
+int bmap(struct inode *inode, int lblk, int *new_block) {
+	return bmap_map(inode, lblk, new_block, BMAP_LOOKUP);
+}
+
+// Points logical block lblk of inode at block pointer pblk, allocating pointer blocks
+// as needed. Returns -1 if a pointer block could not be allocated.
+int bmap_set(struct inode *inode, int lblk, int pblk) {
+	int new_block = 0;
+	if (bmap_map(inode, lblk, &new_block, pblk) != pblk) {
+		return -1;
+	}
+	return 0;
+}
+
+// Gives logical block lblk of inode its own copy of data block pblk if other files
+// share it, so it can be changed in place. The contents are copied unless the
+// caller overwrites the whole block. Returns the block to write, or -1.
+int bmap_unshare(struct inode *inode, int lblk, int pblk, int copy) {
+	if (!block_is_shared(pblk)) {
+		return pblk;
+	}
+	int blkno = get_avail_blkno();
+	if (blkno == -1) {
+		return -1;
+	}
+	if (copy) {
+		char block[BLOCK_SIZE];
+		cache_read(pblk, block);
+		cache_write_ino(blkno, block, inode->ino);
+	}
+	// the entry is mapped already, so this allocates nothing
+	bmap_set(inode, lblk, blkno);
+	free_blkno(pblk); // drops this file's reference
+	return blkno;
+}
+
+// Calls fn on every pointer tree of the block map that overlaps logical blocks [first, last],
+// with the range translated to be relative to the start of that tree
+static int bmap_for_each_tree(struct inode *inode, int first, int last,
+		int (*fn)(struct inode *, int *, int, int, int, void *), void *arg) {
+	int base = DIRECT_PTRS;
+	int span = PTRS_PER_BLOCK;
+	for (int slot = 0; slot < INDIRECT_PTRS; slot++) {
+		int levels = 1;
+		if (slot == DOUBLE_INDIRECT_SLOT) {
+			levels = 2;
+			span = PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+		} else if (slot == TRIPLE_INDIRECT_SLOT) {
+			levels = 3;
+			span = PTRS_PER_BLOCK * PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+		}
+		if (last < base) {
+			break;
+		}
+		if (first <= base + (span - 1)) {
+			int lo = first > base ? first - base : 0;
+			int hi = last - base < span - 1 ? last - base : span - 1;
+			int ret = fn(inode, &inode->indirect_ptr[slot], lo, hi, levels, arg);
+			if (ret != -1) {
+				return base + ret;
+			}
+		}
+		if (slot == TRIPLE_INDIRECT_SLOT) {
+			break;
+		}
+		base += span;
+	}
+	return -1;
+}
+
+struct unmap_ctx {
+	struct block_batch batch;	/* blocks to free before bmap_unmap() returns */
+	struct reclaim_job **detached;	/* fully covered trees go here, if set */
+	int deferred;				/* set once a tree was detached */
+};
+
+// Frees the data blocks for entries [first, last] under the pointer block *ptr,
+// and the pointer block itself once it no longer maps anything
+static int unmap_indirect(struct inode *inode, int *ptr, int first, int last, int levels, void *arg) {
+	struct unmap_ctx *ctx = arg;
+	if (*ptr == -1) {
+		return -1;
+	}
+	int span = 1;
+	for (int l = 1; l < levels; l++) {
+		span *= PTRS_PER_BLOCK;
+	}
+	if (ctx->detached != NULL && first == 0 && last == span * PTRS_PER_BLOCK - 1) {
+		// the whole tree goes, detach it now and let the reclaimer walk it
+		reclaim_detach(ctx->detached, *ptr, levels);
+		*ptr = -1;
+		ctx->deferred = 1;
+		return -1;
+	}
+	int ptrs[PTRS_PER_BLOCK];
+	cache_read(*ptr, ptrs);
+	int changed = 0;
+	for (int idx = first / span; idx <= last / span; idx++) {
+		if (ptrs[idx] == -1) {
+			continue;
+		}
+		if (levels == 1) {
+			batch_add(&ctx->batch, PTR_BLKNO(ptrs[idx]));
+			inode->vstat.st_blocks -= BLOCK_SIZE / 512;
+			ptrs[idx] = -1;
+			changed = 1;
+		} else {
+			int lo = idx * span < first ? first - idx * span : 0;
+			int hi = last - idx * span < span - 1 ? last - idx * span : span - 1;
+			int child = ptrs[idx];
+			unmap_indirect(inode, &child, lo, hi, levels - 1, arg);
+			if (child != ptrs[idx]) {
+				ptrs[idx] = child;
+				changed = 1;
+			}
+		}
+	}
+	int in_use = 0;
+	for (int idx = 0; idx < PTRS_PER_BLOCK; idx++) {
+		if (ptrs[idx] != -1) {
+			in_use = 1;
+			break;
+		}
+	}
+	if (!in_use) {
+		batch_add(&ctx->batch, *ptr);
+		inode->vstat.st_blocks -= BLOCK_SIZE / 512;
+		*ptr = -1;
+	} else if (changed) {
+		cache_write_ino(*ptr, ptrs, inode->ino);
+	}
+	return -1;
+}
+
+// Adds the number of blocks (pointer blocks included) in the tree under ptr to *arg
+static int count_indirect(struct inode *inode, int *ptr, int first, int last, int levels, void *arg) {
+	if (*ptr == -1) {
+		return -1;
+	}
+	int ptrs[PTRS_PER_BLOCK];
+	cache_read(*ptr, ptrs);
+	*(long *)arg += 1;
+	for (int idx = 0; idx < PTRS_PER_BLOCK; idx++) {
+		if (ptrs[idx] == -1) {
+			continue;
+		}
+		if (levels == 1) {
+			*(long *)arg += 1;
+		} else {
+			count_indirect(inode, &ptrs[idx], 0, 0, levels - 1, arg);
+		}
+	}
+	return -1;
+}
+
+// Frees logical blocks [first, last] of inode, the caller writes the inode back.
+// With detached set, whole pointer trees in the range are only taken out of the
+// map and listed there; the caller queues them with reclaim_enqueue_detached()
+// after writing the inode, and the reclaimer thread frees them.
+void bmap_unmap(struct inode *inode, int first, int last, struct reclaim_job **detached) {
+	if (first > last) {
+		return;
+	}
+	struct unmap_ctx ctx = { { NULL, 0, 0 }, detached, 0 };
+	bmap_cache_invalidate(inode->ino);
+	zcache_invalidate(inode->ino);
+	for (int i = first; i < DIRECT_PTRS && i <= last; i++) {
+		if (inode->direct_ptr[i] != -1) {
+			batch_add(&ctx.batch, PTR_BLKNO(inode->direct_ptr[i]));
+			inode->vstat.st_blocks -= BLOCK_SIZE / 512;
+			inode->direct_ptr[i] = -1;
+		}
+	}
+	bmap_for_each_tree(inode, first, last, unmap_indirect, &ctx);
+	batch_release_unmapped(&ctx.batch);
+	if (ctx.deferred) {
+		// detached trees were not counted, recount what the inode still holds
+		long blocks = 0;
+		for (int i = 0; i < DIRECT_PTRS; i++) {
+			if (inode->direct_ptr[i] != -1) {
+				blocks++;
+			}
+		}
+		bmap_for_each_tree(inode, 0, INT_MAX, count_indirect, &blocks);
+		inode->vstat.st_blocks = blocks * (BLOCK_SIZE / 512);
+	}
+}
+
+// Returns the first entry >= first under the pointer block ptr that is mapped
+// (*want_data set) or unmapped (*want_data clear), or -1 if there is none
+static int seek_indirect(struct inode *inode, int *ptr, int first, int last, int levels, void *want_data) {
+	int data = *(int *)want_data;
+	if (*ptr == -1) {
+		return data ? -1 : first;
+	}
+	int ptrs[PTRS_PER_BLOCK];
+	cache_read(*ptr, ptrs);
+	int span = 1;
+	for (int l = 1; l < levels; l++) {
+		span *= PTRS_PER_BLOCK;
+	}
+	for (int idx = first / span; idx <= last / span; idx++) {
+		int lo = idx * span < first ? first - idx * span : 0;
+		if (levels == 1) {
+			if (PTR_HAS_DATA(ptrs[idx]) == data) {
+				return idx;
+			}
+		} else {
+			int hi = last - idx * span < span - 1 ? last - idx * span : span - 1;
+			int child = ptrs[idx];
+			int ret = seek_indirect(inode, &child, lo, hi, levels - 1, want_data);
+			if (ret != -1) {
+				return idx * span + ret;
+			}
+		}
+	}
+	return -1;
+}
+
+// Returns the first logical block >= lblk that holds data (data set) or is a hole,
+// where blocks reserved by fallocate but never written count as holes,
+// skipping whole unmapped pointer trees without reading them. -1 if there is none.
+int bmap_seek(struct inode *inode, int lblk, int data) {
+	for (int i = lblk; i < DIRECT_PTRS; i++) {
+		if (PTR_HAS_DATA(inode->direct_ptr[i]) == data) {
+			return i;
+		}
+	}
+	return bmap_for_each_tree(inode, lblk, INT_MAX, seek_indirect, &data);
+}
+
+
+/*
+ * compressed clusters
+ */
+
+// Returns whether cluster c of inode is stored compressed
+static int cluster_is_compressed(struct inode *inode, int cluster) {
+	int ptr = bmap(inode, cluster * CLUSTER_BLOCKS, NULL);
+	return ptr != -1 && (ptr & COMPRESSED_FLAG);
+}
+
+// Reads and decompresses cluster c into data (CLUSTER_SIZE bytes). The stream
+// starts with its length in bytes and spans the cluster's mapped entries.
+static int cluster_decompress(struct inode *inode, int cluster, char *data) {
+	char *packed = malloc(CLUSTER_SIZE);
+	int nblocks = 0;
+	while (nblocks < CLUSTER_BLOCKS) {
+		int ptr = bmap(inode, cluster * CLUSTER_BLOCKS + nblocks, NULL);
+		if (ptr == -1 || !(ptr & COMPRESSED_FLAG)) {
+			break;
+		}
+		cache_read(PTR_BLKNO(ptr), packed + (size_t)nblocks * BLOCK_SIZE);
+		nblocks++;
+	}
+	uint32_t packed_len;
+	memcpy(&packed_len, packed, sizeof(uint32_t));
+	int ret = -1;
+	if (packed_len <= nblocks * BLOCK_SIZE - sizeof(uint32_t)) {
+		ret = LZ4_decompress_safe(packed + sizeof(uint32_t), data, packed_len, CLUSTER_SIZE);
+	}
+	free(packed);
+	if (ret != CLUSTER_SIZE) {
+		printf("Compressed cluster %d of inode %d is corrupt.\n", cluster, inode->ino);
+		memset(data, 0, CLUSTER_SIZE);
+		return -1;
+	}
+	return 0;
+}
+
+// Reads block lblk of a compressed file into buf. Returns -1 if it is not part of
+// a compressed cluster, then the caller reads it through the block map as usual.
+int cluster_read_block(struct inode *inode, int lblk, void *buf) {
+	int cluster = lblk / CLUSTER_BLOCKS;
+	int offset = (lblk % CLUSTER_BLOCKS) * BLOCK_SIZE;
+	if (zcache_lookup(inode->ino, cluster, offset, BLOCK_SIZE, buf) == 0) {
+		return 0;
+	}
+	if (!cluster_is_compressed(inode, cluster)) {
+		return -1;
+	}
+	char *data = malloc(CLUSTER_SIZE);
+	cluster_decompress(inode, cluster, data);
+	zcache_insert(inode->ino, cluster, data);
+	memcpy(buf, data + offset, BLOCK_SIZE);
+	free(data);
+	return 0;
+}
+
+// Swaps the blocks of cluster c for nblocks new ones holding data, with flag set in
+// their pointers. The new blocks are mapped over the old ones before those are
+// freed, so on -ENOSPC the cluster is left as it was. The caller writes the inode back.
+static int cluster_replace(struct inode *inode, int cluster, const char *data, int nblocks, int flag) {
+	int first = cluster * CLUSTER_BLOCKS;
+	int blknos[CLUSTER_BLOCKS];
+	int old[CLUSTER_BLOCKS];
+	for (int i = 0; i < nblocks; i++) {
+		blknos[i] = get_avail_blkno();
+		if (blknos[i] == -1) {
+			while (i-- > 0) {
+				free_blkno(blknos[i]);
+			}
+			return -ENOSPC;
+		}
+	}
+	bmap_cache_invalidate(inode->ino);
+	zcache_invalidate(inode->ino);
+	for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+		old[i] = bmap(inode, first + i, NULL);
+	}
+	for (int i = 0; i < nblocks; i++) {
+		cache_write_ino(blknos[i], data + (size_t)i * BLOCK_SIZE, inode->ino);
+		if (bmap_set(inode, first + i, blknos[i] | flag) == -1) {
+			// a pointer block was missing and could not be allocated: put the old
+			// pointers back, unmapping drops the new block and any new pointer block
+			for (int j = 0; j < i; j++) {
+				if (old[j] != -1) {
+					bmap_set(inode, first + j, old[j]);
+					free_blkno(blknos[j]);
+				} else {
+					bmap_unmap(inode, first + j, first + j, NULL);
+				}
+			}
+			for (int j = i; j < nblocks; j++) {
+				free_blkno(blknos[j]);
+			}
+			return -ENOSPC;
+		}
+	}
+	// the old blocks go only now, those mapped over and the rest of the cluster
+	struct block_batch batch = { NULL, 0, 0 };
+	for (int i = 0; i < nblocks; i++) {
+		if (old[i] != -1) {
+			batch_add(&batch, PTR_BLKNO(old[i]));
+		}
+	}
+	batch_release_unmapped(&batch);
+	bmap_unmap(inode, first + nblocks, first + CLUSTER_BLOCKS - 1, NULL);
+	return 0;
+}
+
+// Stores cluster c as an LZ4 stream when that takes fewer blocks than it holds now.
+// Meant for clusters that lie entirely below EOF; holes in them compress as zeros.
+void cluster_compress(struct inode *inode, int cluster) {
+	if (cluster_is_compressed(inode, cluster)) {
+		return;
+	}
+	char *data = malloc(CLUSTER_SIZE);
+	int mapped = 0;
+	for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+		int ptr = bmap(inode, cluster * CLUSTER_BLOCKS + i, NULL);
+		if (ptr != -1) {
+			mapped++;
+		}
+		if (PTR_HAS_DATA(ptr)) {
+			cache_read(ptr, data + (size_t)i * BLOCK_SIZE);
+		} else {
+			memset(data + (size_t)i * BLOCK_SIZE, 0, BLOCK_SIZE);
+		}
+	}
+	// the stream has to save at least one block to be worth it
+	int limit = (mapped - 1) * BLOCK_SIZE - (int)sizeof(uint32_t);
+	if (limit <= 0) {
+		free(data);
+		return;
+	}
+	char *packed = calloc(1, CLUSTER_SIZE);
+	uint32_t packed_len = LZ4_compress_default(data, packed + sizeof(uint32_t), CLUSTER_SIZE, limit);
+	if (packed_len > 0) {
+		memcpy(packed, &packed_len, sizeof(uint32_t));
+		int nblocks = (packed_len + sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if (cluster_replace(inode, cluster, packed, nblocks, COMPRESSED_FLAG) == 0) {
+			zcache_insert(inode->ino, cluster, data);
+		}
+	}
+	free(packed);
+	free(data);
+}
+
+// Turns compressed cluster c back into plain blocks before part of it changes.
+// Returns 1 if it was compressed, 0 if it already was plain.
+int cluster_expand(struct inode *inode, int cluster) {
+	if (!cluster_is_compressed(inode, cluster)) {
+		return 0;
+	}
+	char *data = malloc(CLUSTER_SIZE);
+	if (zcache_lookup(inode->ino, cluster, 0, CLUSTER_SIZE, data) == -1) {
+		cluster_decompress(inode, cluster, data);
+	}
+	int ret = cluster_replace(inode, cluster, data, CLUSTER_BLOCKS, 0);
+	free(data);
+	return ret < 0 ? ret : 1;
+}
+
+// Compresses every cluster of [offset, offset + len) that lies entirely below EOF,
+// except those left plain until the file is released
+void cluster_compress_range(struct inode *inode, off_t offset, off_t len) {
+	if (!(inode->flags & INODE_COMPRESSED) || len <= 0) {
+		return;
+	}
+	for (int c = offset / CLUSTER_SIZE; c <= (offset + len - 1) / CLUSTER_SIZE; c++) {
+		if ((off_t)(c + 1) * CLUSTER_SIZE <= inode->size && !recompress_pending(inode->ino, c)) {
+			cluster_compress(inode, c);
+		}
+	}
+}
+
+// Compresses the clusters of file ino that partial writes left plain
+void cluster_recompress(int ino) {
+	int clusters[RECOMPRESS_SLOTS];
+	int n = recompress_take(ino, clusters);
+	if (n == 0) {
+		return;
+	}
+	struct inode inode;
+	pthread_rwlock_wrlock(&remap_lock[ino]);
+	readi(ino, &inode);
+	if (inode.valid && (inode.flags & INODE_COMPRESSED)) {
+		struct inode before;
+		memcpy(&before, &inode, sizeof(struct inode));
+		for (int i = 0; i < n; i++) {
+			if ((off_t)(clusters[i] + 1) * CLUSTER_SIZE <= inode.size) {
+				cluster_compress(&inode, clusters[i]);
+			}
+		}
+		if (memcmp(&before, &inode, sizeof(struct inode)) != 0) {
+			writei(ino, &inode);
+		}
+	}
+	pthread_rwlock_unlock(&remap_lock[ino]);
+}
+
+
+/* 
+ * directory operations
+ */
+
+// FNV-1a hash of a name, never 0 since 0 marks a free slot
+uint32_t dirent_hash(const char *name, size_t len) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return h != 0 ? h : 1;
+}
+
+// Returns a bitmask of the slots of a directory block whose hash is h
+static uint32_t dirent_hash_match(const struct dirent_block *db, uint32_t h) {
+	uint32_t mask = 0;
+#ifdef __SSE2__
+	__m128i want = _mm_set1_epi32((int)h);
+	for (int i = 0; i < DIRENT_HASH_SLOTS; i += 4) {
+		__m128i have = _mm_loadu_si128((const __m128i *)&db->hash[i]);
+		mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(have, want))) << i;
+	}
+#else
+	for (int i = 0; i < DIRENT_HASH_SLOTS; i++) {
+		mask |= (uint32_t)(db->hash[i] == h) << i;
+	}
+#endif
+	return mask;
+}
+
+// Returns the slot of a directory block holding the name, or -1
+static int dirent_block_find(const struct dirent_block *db, const char *fname, size_t name_len, uint32_t h) {
+	uint32_t mask = dirent_hash_match(db, h);
+	while (mask != 0) {
+		int j = __builtin_ctz(mask);
+		mask &= mask - 1;
+		// fname is length-delimited, it may point into the middle of a path
+		if (db->entries[j].len == name_len && memcmp(fname, db->entries[j].name, name_len) == 0) {
+			return j;
+		}
+	}
+	return -1;
+}
+
+// Sets the filter bits of a name hash, double hashing gives the k bit positions
+static void bloom_add(uint8_t *bloom, uint32_t h) {
+	uint32_t h2 = (h * 0x9e3779b1u) | 1;
+	for (int i = 0; i < DIR_BLOOM_HASHES; i++) {
+		uint32_t bit = (h + i * h2) % (DIR_BLOOM_BYTES * 8);
+		bloom[bit / 8] |= 1 << (bit & 7);
+	}
+}
+
+// Returns 0 if the name with hash h is certainly not in the filter
+static int bloom_test(const uint8_t *bloom, uint32_t h) {
+	uint32_t h2 = (h * 0x9e3779b1u) | 1;
+	for (int i = 0; i < DIR_BLOOM_HASHES; i++) {
+		uint32_t bit = (h + i * h2) % (DIR_BLOOM_BYTES * 8);
+		if (!(bloom[bit / 8] & (1 << (bit & 7)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Sets the filter bits of every name in a directory block
+static void bloom_add_block(uint8_t *bloom, const struct dirent_block *db) {
+	for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+		if (db->hash[j] != 0) {
+			bloom_add(bloom, db->hash[j]);
+		}
+	}
+}
+
+// Looks a name up in directory dir. Returns 0 and fills dirent if it is there,
+// -1 if not, and -2 if not and the directory's Bloom filter is missing or stale;
+// then the filter built from the scanned blocks is left in bloom.
+static int dir_scan(struct inode *dir, const char *fname, size_t name_len, uint32_t h,
+		struct dirent *dirent, uint8_t *bloom) {
+	struct dirent_block block;
+	int fresh = 0; // the first block holds a filter that needs no rebuild
+	memset(bloom, 0, DIR_BLOOM_BYTES);
+	for (int i = 0; i < 16; i++) {
+		if (dir->direct_ptr[i] == -1) {
+			continue;
+		}
+		cache_read(dir->direct_ptr[i], &block);
+		if (i == 0 && block.bloom_valid) {
+			// most misses end here, having read no other directory block
+			if (!bloom_test(block.bloom, h)) {
+				return -1;
+			}
+			fresh = block.bloom_stale <= DIR_BLOOM_REBUILD;
+		}
+		// Read directory's data block and check each directory entry.
+		// If the name matches, then copy directory entry to dirent structure
+		int j = dirent_block_find(&block, fname, name_len, h);
+		if (j != -1) {
+			memcpy(dirent, &block.entries[j], sizeof(struct dirent));
+			return 0;
+		}
+		bloom_add_block(bloom, &block);
+	}
+	return fresh ? -1 : -2;
+}
+
+// Stores a filter holding every name of directory dir in its first block.
+// Called with dir_lock held.
+static void dir_bloom_store(struct inode *dir, const uint8_t *bloom) {
+	struct dirent_block block;
+	if (dir->direct_ptr[0] == -1) {
+		return;
+	}
+	cache_read(dir->direct_ptr[0], &block);
+	memcpy(block.bloom, bloom, DIR_BLOOM_BYTES);
+	block.bloom_valid = 1;
+	block.bloom_stale = 0;
+	cache_write_ino(dir->direct_ptr[0], &block, dir->ino);
+}
+
+// Brings the filter in directory dir's first block up to date after the name
+// with hash h was added, or removed (removed set). Called with dir_lock held.
+static void dir_bloom_update(struct inode *dir, uint32_t h, int removed) {
+	struct dirent_block block;
+	if (dir->direct_ptr[0] == -1) {
+		return;
+	}
+	cache_read(dir->direct_ptr[0], &block);
+	if (!block.bloom_valid) {
+		return;
+	}
+	if (removed) {
+		// its filter bits stay set, count them towards a rebuild
+		block.bloom_stale++;
+	} else {
+		bloom_add(block.bloom, h);
+	}
+	cache_write_ino(dir->direct_ptr[0], &block, dir->ino);
+}
+
+// Rebuilds the Bloom filter of directory ino from its entries
+static void dir_bloom_rebuild(uint16_t ino) {
+	pthread_mutex_lock(&dir_lock);
+	struct inode dir;
+	readi(ino, &dir);
+	struct dirent_block block;
+	uint8_t bloom[DIR_BLOOM_BYTES];
+	memset(bloom, 0, DIR_BLOOM_BYTES);
+	for (int i = 0; i < 16; i++) {
+		if (dir.direct_ptr[i] != -1) {
+			cache_read(dir.direct_ptr[i], &block);
+			bloom_add_block(bloom, &block);
+		}
+	}
+	dir_bloom_store(&dir, bloom);
+	pthread_mutex_unlock(&dir_lock);
+}
+
+// Returns -1 if directory doesn't exist
+int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
+	unsigned int seq = __atomic_load_n(&dir_moves, __ATOMIC_ACQUIRE);
+	struct inode directory_inode;
+	readi(ino, &directory_inode);
+  // Step 2: Check its Bloom filter, then each of its data blocks
+	uint32_t h = dirent_hash(fname, name_len);
+	uint8_t bloom[DIR_BLOOM_BYTES];
+	int ret = dir_scan(&directory_inode, fname, name_len, h, dirent, bloom);
+	if ((seq & 1) || __atomic_load_n(&dir_moves, __ATOMIC_ACQUIRE) != seq) {
+		// entries moved under the scan, look again while none can
+		pthread_mutex_lock(&dir_lock);
+		readi(ino, &directory_inode);
+		ret = dir_scan(&directory_inode, fname, name_len, h, dirent, bloom);
+		pthread_mutex_unlock(&dir_lock);
+	}
+	if (ret == 0) {
+		return 0;
+	}
+	if (ret == -2) { // that miss read every block, make the next ones cheap
+		dir_bloom_rebuild(ino);
+	}
+	return -1;
+}
+
+// Fills slot j of a directory block with a new entry
+static void dirent_block_set(struct dirent_block *db, int j, uint16_t f_ino, const char *fname, size_t name_len) {
+	struct dirent *entry = &db->entries[j];
+	entry->ino = f_ino;
+	entry->valid = 1;
+	memcpy(entry->name, fname, name_len);
+	entry->name[name_len] = '\0'; // the slot may hold a longer, removed name
+	entry->len = name_len;
+	db->hash[j] = dirent_hash(fname, name_len);
+}
+
+// Writes a new directory entry into the current directory's data blocks
+int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
+	// Step 2: Check if fname (directory name) is already used in other entries
+	// Step 3: Add directory entry in dir_inode's data block and write to disk
+	// Allocate a new data block for this directory if it does not exist
+	// Update directory inode
+	// Write directory entry
+
+	// Variables
+	struct dirent_block data_block;
+	int entry_added = 0;
+
+	// The caller's copy of the directory inode may be stale by now
+	pthread_mutex_lock(&dir_lock);
+	readi(dir_inode.ino, &dir_inode);
+
+	// Checking to see if a directory already exists with the same name
+	struct dirent existing_entry;
+	uint8_t bloom[DIR_BLOOM_BYTES];
+	int found = dir_scan(&dir_inode, fname, name_len, dirent_hash(fname, name_len), &existing_entry, bloom);
+	if (found == 0) {
+		printf("Directory already exists.\n");
+		pthread_mutex_unlock(&dir_lock);
+		return -EEXIST;
+	}
+	if (found == -2) { // every block was just scanned, store the fresh filter
+		dir_bloom_store(&dir_inode, bloom);
+	}
+
+	// Looking for existing memory block ; only memory block needs to be written to disk
+	for (int i = 0; i < 16; i++) {
+		if (dir_inode.direct_ptr[i] != -1) { // if direct ptr exists
+			cache_read(dir_inode.direct_ptr[i], &data_block); // read data block to memory
+			// a free slot has hash 0
+			uint32_t free_slots = dirent_hash_match(&data_block, 0) & ((1u << DIRENTS_PER_BLOCK) - 1);
+			if (free_slots != 0) {
+				dirent_block_set(&data_block, __builtin_ctz(free_slots), f_ino, fname, name_len);
+				// writing data block to disk
+				cache_write_ino(dir_inode.direct_ptr[i], &data_block, dir_inode.ino);
+				entry_added = 1;
+				break;
+			}
+		} else { // if direct ptr does not exist, initialize it and add the entry there
+			int new_block_no = get_avail_blkno();
+			if (new_block_no == -1) {
+				printf("No available blocks on disk.\n");
+				pthread_mutex_unlock(&dir_lock);
+				return -ENOSPC;
+			}
+			struct dirent_block new_block;
+			memset(&new_block, 0, sizeof(new_block));
+			dirent_block_set(&new_block, 0, f_ino, fname, name_len);
+
+			dir_inode.direct_ptr[i] = new_block_no;
+			cache_write_ino(new_block_no, &new_block, dir_inode.ino); // write new block to disk
+			entry_added = 1;
+			break;
+		}
+	}
+	// Return 0 if success, -EEXIST or -ENOSPC otherwise
+	if (entry_added == 1) {
+		dir_bloom_update(&dir_inode, dirent_hash(fname, name_len), 0);
+		writei(dir_inode.ino, &dir_inode); // write updated inode to disk
+	}
+	pthread_mutex_unlock(&dir_lock);
+	return entry_added ? 0 : -ENOSPC;
+}
+
+// Returns 1 if the directory has no valid entries
+int dir_is_empty(struct inode *dir_inode) {
+	struct dirent_block data_block;
+	for (int i = 0; i < 16; i++) {
+		if (dir_inode->direct_ptr[i] == -1) {
+			continue;
+		}
+		cache_read(dir_inode->direct_ptr[i], &data_block);
+		if ((dirent_hash_match(&data_block, 0) & ((1u << DIRENTS_PER_BLOCK) - 1)) != (1u << DIRENTS_PER_BLOCK) - 1) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Required for 518
+// With only_empty set the entry is removed only if the directory it names has no
+// entries, checked under dir_lock so nothing can be added to it in between.
+// Returns -1 if the entry is missing, -ENOTEMPTY if the directory is not empty
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len, int only_empty) {
+	struct dirent_block data_block;
+	uint32_t h = dirent_hash(fname, name_len);
+	pthread_mutex_lock(&dir_lock);
+	readi(dir_inode.ino, &dir_inode);
+
+	for (int i = 0; i < 16; i++) {
+		if (dir_inode.direct_ptr[i] == -1) {
+			continue;
+		}
+		// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
+		cache_read(dir_inode.direct_ptr[i], &data_block);
+		// Step 2: Check if fname exist
+		int j = dirent_block_find(&data_block, fname, name_len, h);
+		if (j != -1) {
+			if (only_empty) {
+				struct inode target;
+				readi(data_block.entries[j].ino, &target);
+				if (!dir_is_empty(&target)) {
+					pthread_mutex_unlock(&dir_lock);
+					return -ENOTEMPTY;
+				}
+			}
+			// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+			data_block.entries[j].valid = 0;
+			data_block.hash[j] = 0;
+			cache_write_ino(dir_inode.direct_ptr[i], &data_block, dir_inode.ino);
+			dir_bloom_update(&dir_inode, h, 1);
+			pthread_mutex_unlock(&dir_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&dir_lock);
+	return -1;
+}
+
+// Resolves the first path_len bytes of path to an inode, starting at directory ino.
+// Components are compared in place, so lookups allocate nothing at any depth.
+// Returns -1 if directory is missing
+int get_node_by_path_len(const char *path, size_t path_len, uint16_t ino, struct inode *inode) {
+	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
+	// Note: You could either implement it in a iterative way or recursive way
+	struct dirent dirent;
+	readi(ino, inode); // reads root inode
+	const char *cursor = path;
+	const char *name;
+	size_t name_len;
+	while ((name = path_next(&cursor, &name_len)) != NULL && name < path + path_len) {
+		if (name + name_len > path + path_len) {
+			name_len = path + path_len - name;
+		}
+		if (dir_find(inode->ino, name, name_len, &dirent) == -1) {
+			return -1;
+		}
+		readi(dirent.ino, inode);
+	}
+	return 0;
+}
+
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+	return get_node_by_path_len(path, strlen(path), ino, inode);
+}
+
+/* 
+ * Make file system
+ */
 int rufs_mkfs() {
 	// Call dev_init() to initialize (Create) Diskfile
 	dev_init(diskfile_path);
@@ -400,413 +3358,1759 @@ int rufs_mkfs() {
 	inode_bitmap_init();
 	// initialize data block bitmap
 	data_block_bitmap_init();
+	// no data block is shared yet
+	block_refs_init();
 	// update bitmap information for root directory
 	set_bitmap(inode_bitmap, 0);
-	bio_write(superblock->i_bitmap_blk, inode_bitmap);
+	superblock->free_inodes--;
+	inode_bitmap_write();
 	set_bitmap(data_block_bitmap, 0);
-	bio_write(superblock->d_bitmap_blk, data_block_bitmap);
+	superblock->free_blocks--;
+	data_block_bitmap_write();
 	// update inode for root directory
 	root_inode_init();
 	return 0;
 }
 
 
-/* 
- * FUSE file operations
- */
-static void* rufs_init(struct fuse_conn_info *conn) {
-	superblock = malloc(sizeof(struct superblock));
-	// Step 1a: If disk file is not found, call mkfs
-	if (dev_open(diskfile_path) == -1) {
-		printf("Disk file not found. Formatting disk...\n");
-		rufs_mkfs();
+/* 
+ * FUSE file operations
+ */
+static void* rufs_init(struct fuse_conn_info *conn) {
+	// the superblock is read and written as a whole block
+	superblock = malloc(BLOCK_SIZE);
+	memset(superblock, 0, BLOCK_SIZE);
+	for (int i = 0; i < MAX_INUM; i++) {
+		pthread_rwlock_init(&remap_lock[i], NULL);
+	}
+	bmap_cache_init();
+	zcache_init();
+	cache_init(options.cache_blocks);
+	// Step 1a: If disk file is not found, call mkfs
+	if (dev_open(diskfile_path) == -1) {
+		printf("Disk file not found. Formatting disk...\n");
+		rufs_mkfs();
+	} else {
+	// Step 1b: If disk file is found, just initialize in-memory data structures and read superblock from disk
+		cache_read(0, superblock);
+		if (superblock->magic_num != MAGIC_NUM) {
+			fprintf(stderr, "Disk has magic number 0x%x, this rufs formats 0x%x.\n",
+				superblock->magic_num, MAGIC_NUM);
+			exit(EXIT_FAILURE);
+		}
+		// block 0 sits at the start of DISKFILE with any stripe layout, so it can be
+		// read before the layout is checked
+		int devices, unit;
+		dev_stripe_geometry(&devices, &unit);
+		if ((int)superblock->stripe_devs != devices || (devices > 1 && superblock->stripe_unit != unit)) {
+			fprintf(stderr, "Disk is striped over %d device(s) with unit %d, mounted with %d and %d.\n",
+				(int)superblock->stripe_devs, superblock->stripe_unit, devices, unit);
+			exit(EXIT_FAILURE);
+		}
+		inode_bitmap = malloc(BLOCK_SIZE);
+		cache_read(superblock->i_bitmap_blk, inode_bitmap);
+		data_block_bitmap = malloc(BLOCK_SIZE);
+		cache_read(superblock->d_bitmap_blk, data_block_bitmap);
+		block_refs = malloc(REFCOUNT_BLOCKS * BLOCK_SIZE);
+		for (int i = 0; i < REFCOUNT_BLOCKS; i++) {
+			cache_read(superblock->r_start_blk + i, (char *)block_refs + (size_t)i * BLOCK_SIZE);
+		}
+		// the counters on disk are only exact after a clean unmount
+		if (!superblock->clean) {
+			superblock_count_free();
+			superblock_raise_itable_mark();
+		}
+	}
+	// until unmount the counters on disk may fall behind the bitmaps
+	if (superblock_mark_dirty() == -1) {
+		fprintf(stderr, "Cannot write the superblock.\n");
+		exit(EXIT_FAILURE);
+	}
+	buddy_init();
+	magazine_start();
+	reclaim_start();
+	flusher_start();
+	// mount doesn't wait for the inode table, it is zeroed and read in the background
+	itable_start();
+	// let the kernel splice read_buf/write_buf data straight to and from the device file
+	if (conn != NULL) {
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	}
+	// started here, since the threads of main() don't survive fuse_main() daemonizing
+	if (options.trace != NULL && trace_start(options.trace) == -1) {
+		fprintf(stderr, "Cannot record the trace to %s.\n", options.trace);
+		exit(EXIT_FAILURE);
+	}
+	printf("RUFS initialized.\n");
+	return NULL;
+}
+
+static void rufs_destroy(void *userdata) {
+
+	// Step 1: Finish deferred frees and write back every dirty block,
+	// then de-allocate in-memory data structures
+	trace_stop();
+	itable_finish();
+	orphans_reclaim();
+	reclaim_finish();
+	// reservations go back so the counters written below are exact
+	magazine_stop();
+	times_flush(-1, 1);
+	flusher_stop();
+	discard_pass(1);
+	superblock_write(1);
+	cache_flush(1);
+	free(superblock);
+	free(inode_bitmap);
+	free(data_block_bitmap);
+	free(block_refs);
+	// Step 2: Close diskfile
+	dev_close();
+	cache_destroy();
+	zcache_destroy();
+
+}
+
+static int rufs_getattr(const char *path, struct stat *stbuf) {
+
+	// Step 1: call get_node_by_path() to get inode from path
+	struct inode *inode = malloc(sizeof(struct inode));
+	if (get_node_by_path(path, 0, inode) == -1) {
+		printf("Invalid path.\n");
+		return -ENOENT;
+	}
+	// Step 2: fill attribute of file into stbuf from inode
+	if (inode->ino == 0) { // if root directory
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else { // if other directories
+		stbuf->st_mode = inode->type | 0755;
+		stbuf->st_nlink = inode->link;
+	}
+	stbuf->st_atim = inode->vstat.st_atim;
+	stbuf->st_blksize = inode->vstat.st_blksize;
+	stbuf->st_blocks = inode->vstat.st_blocks;
+	stbuf->st_ctim = inode->vstat.st_ctim;
+	stbuf->st_dev = inode->vstat.st_dev;
+	stbuf->st_gid = getgid();
+	stbuf->st_ino = inode->vstat.st_ino;
+	stbuf->st_mtim = inode->vstat.st_mtim;
+	stbuf->st_rdev = inode->vstat.st_rdev;
+	stbuf->st_size = inode->size;
+	stbuf->st_uid = getuid();
+	
+	free(inode);
+
+	return 0;
+}
+
+// df and friends, answered from the superblock counters without touching a bitmap
+static int rufs_statfs(const char *path, struct statvfs *stbuf) {
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_namemax = DIRENT_NAME_LEN - 1;
+	pthread_mutex_lock(&alloc_lock);
+	stbuf->f_blocks = superblock->max_dnum;
+	// what the allocation magazines hold, and freed blocks waiting for their
+	// discard, are still free to any file
+	int reserved_blocks = __atomic_load_n(&magazine_blocks, __ATOMIC_RELAXED) + discard_blocks;
+	int reserved_inos = __atomic_load_n(&magazine_inos, __ATOMIC_RELAXED);
+	stbuf->f_bfree = superblock->free_blocks + reserved_blocks;
+	stbuf->f_bavail = superblock->free_blocks + reserved_blocks;
+	stbuf->f_files = superblock->max_inum;
+	stbuf->f_ffree = superblock->free_inodes + reserved_inos;
+	stbuf->f_favail = superblock->free_inodes + reserved_inos;
+	pthread_mutex_unlock(&alloc_lock);
+	return 0;
+}
+
+static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode inode;
+	// Step 2: If not find, return -1
+	if (get_node_by_path(path, 0, &inode) == -1) {
+		printf("Invalid path.\n");
+		return -1;
+	} else {
+		fi->fh = inode.ino;
+		inode_open(inode.ino);
+		return 0;
+	}
+}
+
+// ls command
+static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode inode;
+	if (get_node_by_path(path, 0, &inode) == -1) {
+		printf("Invalid path.\n");
+		return -1;
+	}
+	// Step 2: Read directory entries from its data blocks, and copy them to filler
+	struct dirent_block block;
+
+	for (int i = 0; i < 16; i++) {
+		if (inode.direct_ptr[i] != -1) {
+			cache_read(inode.direct_ptr[i], &block);
+			struct dirent* entry = block.entries;
+			for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+				if (entry->valid) {
+					filler(buffer, entry->name, NULL, 0);
+				}
+				entry++;
+			}
+		}
+	}
+	if (atime_due(&inode)) {
+		times_touch(inode.ino, TIME_ATIME);
+	}
+	return 0;
+}
+
+
+static int rufs_mkdir(const char *path, mode_t mode) {
+	// Step 1: Split the path into parent directory and target directory name, in place
+	size_t parent_len, name_len;
+	const char *base_name = path_split(path, &parent_len, &name_len);
+	if (base_name == NULL) {
+		return -EEXIST;
+	}
+	if (name_len >= DIRENT_NAME_LEN) {
+		return -ENAMETOOLONG;
+	}
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+	struct inode inode;
+	if (get_node_by_path_len(path, parent_len, 0, &inode) == -1) {
+		return -ENOENT;
+	}
+	// Step 3: Look the name up before anything is allocated for it
+	struct dirent dirent;
+	if (dir_find(inode.ino, base_name, name_len, &dirent) == 0) {
+		return -EEXIST;
+	}
+	// get an available inode number and the directory's first block
+	int available_inode_no = get_avail_ino();
+	if (available_inode_no == -1) {
+		return -ENOSPC;
+	}
+	int blkno = get_avail_blkno();
+	if (blkno == -1) {
+		free_ino(available_inode_no);
+		return -ENOSPC;
+	}
+	// Step 4: Call dir_add() to add directory entry of target directory to parent directory,
+	// which fails if the name was added meanwhile
+	int ret = dir_add(inode, available_inode_no, base_name, name_len);
+	if (ret < 0) {
+		free_blkno(blkno);
+		free_ino(available_inode_no);
+		return ret;
+	}
+	// Step 6: Call writei() to write inode to disk
+	struct inode* new_inode = malloc(sizeof(struct inode));
+	memset(new_inode, 0, sizeof(struct inode));
+	new_inode->ino = available_inode_no;
+	new_inode->valid = 1;
+	new_inode->size = BLOCK_SIZE;
+	new_inode->type = S_IFDIR | 0755;
+	new_inode->link = 2;
+	new_inode->direct_ptr[0] = blkno;
+	new_inode->vstat.st_blocks = BLOCK_SIZE / 512;
+	inode_touch(new_inode, TIME_ATIME | TIME_MTIME | TIME_CTIME);
+	// the block may have been freed by another file, start with no entries,
+	// for which an empty filter is exact
+	struct dirent_block empty_block;
+	memset(&empty_block, 0, sizeof(empty_block));
+	empty_block.bloom_valid = 1;
+	cache_write_ino(new_inode->direct_ptr[0], &empty_block, new_inode->ino);
+	
+	for (int i = 1; i < 16; i++) {
+		new_inode->direct_ptr[i] = -1;
+	}
+	for (int i = 0; i < 8; i++) {
+		new_inode->indirect_ptr[i] = -1;
+	}
+	writei(available_inode_no, new_inode);
+	free(new_inode);
+	times_touch(inode.ino, TIME_MTIME | TIME_CTIME);
+
+	return 0;
+}
+
+// Required for 518
+static int rufs_rmdir(const char *path) {
+
+	// Step 1: Split the path into parent directory and target directory name, in place
+	size_t parent_len, name_len;
+	const char *base_name = path_split(path, &parent_len, &name_len);
+	int ret = 0;
+
+	// Step 2: Call get_node_by_path() to get inode of target directory
+	struct inode target;
+	struct inode parent;
+	if (get_node_by_path(path, 0, &target) == -1) {
+		ret = -ENOENT;
+	} else if (target.ino == 0 || base_name == NULL) {
+		ret = -EBUSY;
+	} else if (!S_ISDIR(target.type)) {
+		ret = -ENOTDIR;
+	// Step 5: Call get_node_by_path() to get inode of parent directory
+	} else if (get_node_by_path_len(path, parent_len, 0, &parent) == -1) {
+		ret = -ENOENT;
+	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent
+	// directory, if it is still empty
+	} else if ((ret = dir_remove(parent, base_name, name_len, 1)) != 0) {
+		ret = ret == -1 ? -ENOENT : ret;
+	} else {
+		// Step 3-4: Clearing the inode and its data blocks is left to the reclaimer,
+		// after the last handle on it is released
+		inode_unlinked(target.ino);
+		times_touch(parent.ino, TIME_MTIME | TIME_CTIME);
+	}
+	return ret;
+}
+
+static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
+	inode_release(fi->fh);
+    return 0;
+}
+
+static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+
+	// Step 1: Split the path into parent directory and target file name, in place
+	size_t parent_len, name_len;
+	const char *base_name = path_split(path, &parent_len, &name_len);
+	if (base_name == NULL) {
+		return -EEXIST;
+	}
+	if (name_len >= DIRENT_NAME_LEN) {
+		return -ENAMETOOLONG;
+	}
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+	struct inode inode;
+	if (get_node_by_path_len(path, parent_len, 0, &inode) == -1) {
+		return -ENOENT;
+	}
+	// Look the name up before anything is allocated for it
+	struct dirent dirent;
+	if (dir_find(inode.ino, base_name, name_len, &dirent) == 0) {
+		return -EEXIST;
+	}
+	// Step 3: Call get_avail_ino() to get an available inode number
+	int available_inode_no = get_avail_ino();
+	if (available_inode_no == -1) {
+		return -ENOSPC;
+	}
+	// Step 4: Call dir_add() to add directory entry of target file to parent directory,
+	// which fails if the name was added meanwhile
+	int ret = dir_add(inode, available_inode_no, base_name, name_len);
+	if (ret < 0) {
+		free_ino(available_inode_no);
+		return ret;
+	}
+	// Step 5: Update inode for target file
+	// Step 6: Call writei() to write inode to disk
+	// Files start empty, data blocks are allocated by the writes that touch them
+	struct inode* new_inode = malloc(sizeof(struct inode));
+	memset(new_inode, 0, sizeof(struct inode));
+	new_inode->ino = available_inode_no;
+	new_inode->valid = 1;
+	new_inode->size = 0;
+	new_inode->type = S_IFREG | 0644;
+	new_inode->link = 1;
+	new_inode->flags = options.compress ? INODE_COMPRESSED : 0;
+	inode_touch(new_inode, TIME_ATIME | TIME_MTIME | TIME_CTIME);
+	
+	for (int i = 0; i < 16; i++) {
+		new_inode->direct_ptr[i] = -1;
+	}
+	for (int i = 0; i < 8; i++) {
+		new_inode->indirect_ptr[i] = -1;
+	}
+	writei(available_inode_no, new_inode);
+	fi->fh = available_inode_no;
+	inode_open(available_inode_no);
+	free(new_inode);
+	times_touch(inode.ino, TIME_MTIME | TIME_CTIME);
+	return 0;
+}
+
+static int rufs_open(const char *path, struct fuse_file_info *fi) {
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	// Step 2: If not find, return -1
+	struct inode inode;
+	if (get_node_by_path(path, 0, &inode) == -1) {
+		printf("Failed to open file.\n");
+		return -1;
+	}
+	fi->fh = inode.ino;
+	inode_open(inode.ino);
+	return 0;
+}
+
+// Fetches the data blocks of logical blocks [first, last] the cache lacks in one
+// batch, so striped devices work on them in parallel
+static void file_readahead(struct inode *inode, int first, int last) {
+	if (last <= first || (inode->flags & INODE_COMPRESSED)) {
+		return;
+	}
+	int *blknos = malloc(sizeof(int) * (last - first + 1));
+	int n = 0;
+	for (int lblk = first; lblk <= last; lblk++) {
+		int pblk = bmap(inode, lblk, NULL);
+		if (PTR_HAS_DATA(pblk) && !cache_contains(pblk)) {
+			blknos[n++] = pblk;
+		}
+	}
+	cache_readahead(blknos, n);
+	free(blknos);
+}
+
+static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+	// Step 1: You could call get_node_by_path() to get inode from path
+	struct inode inode;
+	if (get_node_by_path(path, 0, &inode) == -1) {
+		return -ENOENT;
+	}
+	// the block map may have changed before the lock was taken
+	pthread_rwlock_rdlock(&remap_lock[inode.ino]);
+	readi(inode.ino, &inode);
+	if (offset >= inode.size) {
+		pthread_rwlock_unlock(&remap_lock[inode.ino]);
+		return 0;
+	}
+	if (offset + size > inode.size) {
+		size = inode.size - offset;
+	}
+	int bytes_read = 0; // total bytes read
+	char block[BLOCK_SIZE];
+	file_readahead(&inode, offset / BLOCK_SIZE, (offset + size - 1) / BLOCK_SIZE);
+	// Step 2: Based on size and offset, read its data blocks from disk
+	while (bytes_read < size) {
+		off_t pos = offset + bytes_read;
+		int block_offset = pos % BLOCK_SIZE;
+		int bytes_to_read = BLOCK_SIZE - block_offset;
+		if (bytes_to_read > size - bytes_read) {
+			bytes_to_read = size - bytes_read;
+		}
+		// Step 3: copy the correct amount of data from offset to buffer
+		if ((inode.flags & INODE_COMPRESSED) && cluster_read_block(&inode, pos / BLOCK_SIZE, block) == 0) {
+			memcpy(buffer + bytes_read, block + block_offset, bytes_to_read);
+			bytes_read += bytes_to_read;
+			continue;
+		}
+		int pblk = bmap(&inode, pos / BLOCK_SIZE, NULL);
+		if (!PTR_HAS_DATA(pblk)) { // holes and unwritten blocks read back as zeros
+			memset(buffer + bytes_read, 0, bytes_to_read);
+		} else {
+			cache_read(pblk, block);
+			memcpy(buffer + bytes_read, block + block_offset, bytes_to_read);
+		}
+		bytes_read += bytes_to_read;
+	}
+	pthread_rwlock_unlock(&remap_lock[inode.ino]);
+	if (atime_due(&inode)) {
+		times_touch(inode.ino, TIME_ATIME);
+	}
+	// Note: this function should return the amount of bytes you copied to buffer
+	return bytes_read;
+}
+
+static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	if (offset + size > UINT32_MAX) { // inode size is 32 bits
+		return -EFBIG;
+	}
+	// Step 1: You could call get_node_by_path() to get inode from path
+	struct inode inode;
+	if (get_node_by_path(path, 0, &inode) == -1) {
+		return -ENOENT;
+	}
+	// the block map may have changed before the lock was taken
+	pthread_rwlock_wrlock(&remap_lock[inode.ino]);
+	readi(inode.ino, &inode);
+	// an overwrite that leaves the inode as it was only has to update its times
+	struct inode before;
+	memcpy(&before, &inode, sizeof(struct inode));
+	int bytes_written = 0; // total bytes written
+	char block[BLOCK_SIZE];
+	// Step 2: Based on size and offset, map (allocating as needed) its data blocks
+	while (bytes_written < size) {
+		off_t pos = offset + bytes_written;
+		int block_offset = pos % BLOCK_SIZE;
+		int bytes_to_write = BLOCK_SIZE - block_offset;
+		if (bytes_to_write > size - bytes_written) {
+			bytes_to_write = size - bytes_written;
+		}
+		// a compressed cluster is rewritten as plain blocks. One this write covers
+		// whole is compressed again below, one it covers in part once the file is
+		// released, so further small writes into it find plain blocks.
+		if (inode.flags & INODE_COMPRESSED) {
+			int cluster = pos / CLUSTER_SIZE;
+			int expanded = cluster_expand(&inode, cluster);
+			if (expanded < 0) {
+				break;
+			}
+			int whole = offset <= (off_t)cluster * CLUSTER_SIZE && offset + size >= (off_t)(cluster + 1) * CLUSTER_SIZE;
+			if (expanded && !whole) {
+				recompress_defer(inode.ino, cluster);
+			}
+		}
+		int new_block = 0;
+		int pblk = bmap(&inode, pos / BLOCK_SIZE, &new_block);
+		if (pblk == -1) {
+			break;
+		}
+		if (pblk & UNWRITTEN_FLAG) { // first write to a preallocated block converts it
+			pblk = PTR_BLKNO(pblk);
+			bmap_set(&inode, pos / BLOCK_SIZE, pblk);
+			new_block = 1;
+		} else if (!new_block) { // a block shared with a reflinked file is copied first
+			pblk = bmap_unshare(&inode, pos / BLOCK_SIZE, pblk, bytes_to_write < BLOCK_SIZE);
+			if (pblk == -1) {
+				break;
+			}
+		}
+		// Step 3: Write the correct amount of data from offset to disk
+		if (bytes_to_write < BLOCK_SIZE) { // partial block, keep the rest of it
+			if (new_block) {
+				memset(block, 0, BLOCK_SIZE);
+			} else {
+				cache_read(pblk, block);
+			}
+		}
+		memcpy(block + block_offset, buffer + bytes_written, bytes_to_write);
+		cache_write_ino(pblk, block, inode.ino);
+		bytes_written += bytes_to_write;
+	}
+	// Step 4: Update the inode info and write it to disk
+	if (offset + bytes_written > inode.size) {
+		inode.size = offset + bytes_written;
+	}
+	cluster_compress_range(&inode, offset, bytes_written);
+	if (memcmp(&before, &inode, sizeof(struct inode)) != 0) {
+		inode_touch(&inode, TIME_MTIME | TIME_CTIME);
+		writei(inode.ino, &inode);
+	} else if (bytes_written > 0) {
+		times_touch(inode.ino, TIME_MTIME | TIME_CTIME);
+	}
+	pthread_rwlock_unlock(&remap_lock[inode.ino]);
+	if (bytes_written == 0 && size > 0) {
+		return -ENOSPC;
+	}
+	// Note: this function should return the amount of bytes you write to disk
+	return bytes_written;
+}
+
+// Appends len bytes at device offset pos of fd to a bufvec, merging with the
+// previous segment when it ends right where this one starts
+static void bufvec_add_fd(struct fuse_bufvec *bufv, int fd, off_t pos, size_t len) {
+	if (bufv->count > 0) {
+		struct fuse_buf *last = &bufv->buf[bufv->count - 1];
+		if ((last->flags & FUSE_BUF_IS_FD) && last->fd == fd && last->pos + last->size == pos) {
+			last->size += len;
+			return;
+		}
+	}
+	struct fuse_buf *seg = &bufv->buf[bufv->count++];
+	seg->size = len;
+	seg->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	seg->mem = NULL;
+	seg->fd = fd;
+	seg->pos = pos;
+}
+
+// Returns room for len more bytes in a memory segment at the end of the bufvec.
+// Memory segments are malloc'd because libfuse frees them after the reply.
+static char* bufvec_add_mem(struct fuse_bufvec *bufv, size_t len) {
+	struct fuse_buf *last = bufv->count > 0 ? &bufv->buf[bufv->count - 1] : NULL;
+	if (last == NULL || (last->flags & FUSE_BUF_IS_FD)) {
+		last = &bufv->buf[bufv->count++];
+		last->size = 0;
+		last->flags = 0;
+		last->mem = NULL;
+		last->fd = -1;
+		last->pos = 0;
+	}
+	last->mem = realloc(last->mem, last->size + len);
+	last->size += len;
+	return (char *)last->mem + last->size - len;
+}
+
+// Zero-copy read: data blocks are handed to FUSE as segments of the device file,
+// so the kernel can splice them to /dev/fuse. Holes, unwritten blocks and blocks
+// of backends without an fd go through memory.
+static int rufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct inode inode;
+	pthread_rwlock_rdlock(&remap_lock[fi->fh]);
+	readi(fi->fh, &inode);
+	if (offset >= inode.size) {
+		size = 0;
+	} else if (offset + size > inode.size) {
+		size = inode.size - offset;
+	}
+	int nblocks = size == 0 ? 0 : (offset + size - 1) / BLOCK_SIZE - offset / BLOCK_SIZE + 1;
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf) * nblocks);
+	*bufv = FUSE_BUFVEC_INIT(0);
+	bufv->count = 0;
+	off_t dev_pos;
+	if (nblocks > 0 && dev_block_fd(superblock->d_start_blk, &dev_pos) < 0) {
+		// no fd to splice from, every block goes through the cache
+		file_readahead(&inode, offset / BLOCK_SIZE, (offset + size - 1) / BLOCK_SIZE);
+	}
+
+	size_t bytes_read = 0;
+	while (bytes_read < size) {
+		off_t pos = offset + bytes_read;
+		int block_offset = pos % BLOCK_SIZE;
+		size_t len = BLOCK_SIZE - block_offset;
+		if (len > size - bytes_read) {
+			len = size - bytes_read;
+		}
+		char block[BLOCK_SIZE];
+		if ((inode.flags & INODE_COMPRESSED) && cluster_read_block(&inode, pos / BLOCK_SIZE, block) == 0) {
+			memcpy(bufvec_add_mem(bufv, len), block + block_offset, len);
+			bytes_read += len;
+			continue;
+		}
+		int pblk = bmap(&inode, pos / BLOCK_SIZE, NULL);
+		int fd = PTR_HAS_DATA(pblk) ? dev_block_fd(pblk, &dev_pos) : -1;
+		if (fd >= 0 && cache_read_dirty(pblk, block)) {
+			// the device copy is stale until the flusher gets to this block
+			memcpy(bufvec_add_mem(bufv, len), block + block_offset, len);
+		} else if (fd >= 0) {
+			bufvec_add_fd(bufv, fd, dev_pos + block_offset, len);
+		} else if (PTR_HAS_DATA(pblk)) {
+			cache_read(pblk, block);
+			memcpy(bufvec_add_mem(bufv, len), block + block_offset, len);
+		} else {
+			memset(bufvec_add_mem(bufv, len), 0, len);
+		}
+		bytes_read += len;
+	}
+	// FUSE copies the fd segments after this returns, which the lock can't cover:
+	// blocks the file stops mapping are kept for SPLICE_GRACE_MS for them
+	pthread_rwlock_unlock(&remap_lock[fi->fh]);
+	if (atime_due(&inode)) {
+		times_touch(inode.ino, TIME_ATIME);
+	}
+	*bufp = bufv;
+	return 0;
+}
+
+// A piece of a write_buf request aimed at a block the cache holds
+struct cached_piece {
+	int blkno;
+	int new_block;
+	int block_offset;
+	size_t len;
+	size_t buf_offset;	/* where the piece starts in the request */
+	char *data;
+};
+
+// Zero-copy write: the caller's buffer is copied straight into the data blocks'
+// extents of the device file with fuse_buf_copy(), which splices when it can.
+// Blocks the cache holds are updated through the cache instead.
+static int rufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	size_t size = fuse_buf_size(buf);
+	off_t dev_pos;
+	struct inode inode;
+	pthread_rwlock_wrlock(&remap_lock[fi->fh]);
+	readi(fi->fh, &inode);
+	if (dev_block_fd(superblock->d_start_blk, &dev_pos) < 0 || (inode.flags & INODE_COMPRESSED)) {
+		pthread_rwlock_unlock(&remap_lock[fi->fh]);
+		// no device fd to splice into, or the data gets compressed anyway:
+		// take one copy and use the block path
+		char *data = malloc(size);
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		dst.buf[0].mem = data;
+		ssize_t copied = fuse_buf_copy(&dst, buf, 0);
+		int ret = copied < 0 ? copied : rufs_write(path, data, copied, offset, fi);
+		free(data);
+		return ret;
+	}
+
+	if (offset + size > UINT32_MAX) {
+		pthread_rwlock_unlock(&remap_lock[fi->fh]);
+		return -EFBIG;
+	}
+	struct inode before;
+	memcpy(&before, &inode, sizeof(struct inode));
+	int nblocks = size == 0 ? 0 : (offset + size - 1) / BLOCK_SIZE - offset / BLOCK_SIZE + 1;
+	struct fuse_bufvec *dst = malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf) * nblocks);
+	*dst = FUSE_BUFVEC_INIT(0);
+	dst->count = 0;
+
+	size_t mapped = 0;
+	char zero_block[BLOCK_SIZE];
+	memset(zero_block, 0, BLOCK_SIZE);
+	struct cached_piece *pieces = NULL;
+	char *staging = NULL;
+	int npieces = 0;
+	int *spliced = malloc(sizeof(int) * (nblocks + 1));
+	int nspliced = 0;
+	// new blocks only partly written are zeroed first, at most one at either end
+	struct bio zero_bios[2];
+	int nzero = 0;
+	while (mapped < size) {
+		off_t pos = offset + mapped;
+		int block_offset = pos % BLOCK_SIZE;
+		size_t len = BLOCK_SIZE - block_offset;
+		if (len > size - mapped) {
+			len = size - mapped;
+		}
+		int new_block = 0;
+		int pblk = bmap(&inode, pos / BLOCK_SIZE, &new_block);
+		if (pblk == -1) {
+			break;
+		}
+		if (pblk & UNWRITTEN_FLAG) { // first write to a preallocated block converts it
+			pblk = PTR_BLKNO(pblk);
+			bmap_set(&inode, pos / BLOCK_SIZE, pblk);
+			new_block = 1;
+		} else if (!new_block) { // a block shared with a reflinked file is copied first
+			pblk = bmap_unshare(&inode, pos / BLOCK_SIZE, pblk, len < BLOCK_SIZE);
+			if (pblk == -1) {
+				break;
+			}
+		}
+		if (cache_contains(pblk)) {
+			if (pieces == NULL) {
+				pieces = malloc(sizeof(struct cached_piece) * nblocks);
+				staging = malloc((size_t)BLOCK_SIZE * nblocks);
+			}
+			struct cached_piece *piece = &pieces[npieces];
+			piece->blkno = pblk;
+			piece->new_block = new_block;
+			piece->block_offset = block_offset;
+			piece->len = len;
+			piece->buf_offset = mapped;
+			piece->data = staging + (size_t)BLOCK_SIZE * npieces++;
+			struct fuse_buf *seg = &dst->buf[dst->count++];
+			seg->size = len;
+			seg->flags = 0;
+			seg->mem = piece->data;
+			seg->fd = -1;
+			seg->pos = 0;
+		} else {
+			if (new_block && len < BLOCK_SIZE) {
+				// the part of a new block this write doesn't cover has to read as zeros
+				zero_bios[nzero++] = (struct bio){ pblk, zero_block, 1, 0 };
+			}
+			int fd = dev_block_fd(pblk, &dev_pos);
+			bufvec_add_fd(dst, fd, dev_pos + block_offset, len);
+			spliced[nspliced++] = pblk;
+		}
+		mapped += len;
+	}
+
+	// both ends together, striped devices zero them in parallel
+	bio_submit(zero_bios, nzero);
+	// pieces updated in part are read back, in one batch if the cache lost them
+	int partial[2];
+	int npartial = 0;
+	for (int i = 0; i < npieces; i++) {
+		if (!pieces[i].new_block && pieces[i].len < BLOCK_SIZE) {
+			partial[npartial++] = pieces[i].blkno;
+		}
+	}
+	cache_readahead(partial, npartial);
+	ssize_t written = 0;
+	if (mapped > 0) {
+		written = fuse_buf_copy(dst, buf, 0);
+	}
+	// a reader may have cached one of these blocks between cache_contains() and
+	// the splice, that copy holds the old data now
+	for (int i = 0; i < nspliced; i++) {
+		cache_invalidate(spliced[i]);
+	}
+	free(spliced);
+	for (int i = 0; i < npieces && written > 0 && pieces[i].buf_offset < written; i++) {
+		struct cached_piece *piece = &pieces[i];
+		size_t len = piece->len;
+		if (piece->buf_offset + len > written) {
+			len = written - piece->buf_offset;
+		}
+		char block[BLOCK_SIZE];
+		if (piece->new_block) {
+			memset(block, 0, BLOCK_SIZE);
+		} else if (len < BLOCK_SIZE) {
+			cache_read(piece->blkno, block);
+		}
+		memcpy(block + piece->block_offset, piece->data, len);
+		cache_write_ino(piece->blkno, block, inode.ino);
+	}
+	free(pieces);
+	free(staging);
+	free(dst);
+	if (written > 0 && offset + written > inode.size) {
+		inode.size = offset + written;
+	}
+	if (memcmp(&before, &inode, sizeof(struct inode)) != 0) {
+		inode_touch(&inode, TIME_MTIME | TIME_CTIME);
+		writei(inode.ino, &inode);
+	} else if (written > 0) {
+		times_touch(inode.ino, TIME_MTIME | TIME_CTIME);
+	}
+	pthread_rwlock_unlock(&remap_lock[fi->fh]);
+	if (written < 0) {
+		return written;
+	}
+	if (written == 0 && size > 0) {
+		return -ENOSPC;
+	}
+	return written;
+}
+
+// Required for 518
+
+static int rufs_unlink(const char *path) {
+
+	// Step 1: Split the path into parent directory and target file name, in place
+	size_t parent_len, name_len;
+	const char *base_name = path_split(path, &parent_len, &name_len);
+	int ret = 0;
+
+	// Step 2: Call get_node_by_path() to get inode of target file
+	struct inode target;
+	struct inode parent;
+	if (get_node_by_path(path, 0, &target) == -1) {
+		ret = -ENOENT;
+	} else if (S_ISDIR(target.type) || base_name == NULL) {
+		ret = -EISDIR;
+	// Step 5: Call get_node_by_path() to get inode of parent directory
+	} else if (get_node_by_path_len(path, parent_len, 0, &parent) == -1) {
+		ret = -ENOENT;
+	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
+	} else if (dir_remove(parent, base_name, name_len, 0) == -1) {
+		ret = -ENOENT;
+	} else if (target.link > 1) {
+		// the copy read above may be stale, writes change the inode meanwhile
+		pthread_rwlock_wrlock(&remap_lock[target.ino]);
+		readi(target.ino, &target);
+		target.link--;
+		inode_touch(&target, TIME_CTIME);
+		writei(target.ino, &target);
+		pthread_rwlock_unlock(&remap_lock[target.ino]);
+		times_touch(parent.ino, TIME_MTIME | TIME_CTIME);
 	} else {
-	// Step 1b: If disk file is found, just initialize in-memory data structures and read superblock from disk
-		bio_read(0, superblock);
+		// Step 3-4: Clearing the inode, its bitmap bit and its data blocks is left to
+		// the reclaimer, so removing large files returns as soon as the entry is gone.
+		// A file still open keeps them until its last handle is released.
+		inode_unlinked(target.ino);
+		times_touch(parent.ino, TIME_MTIME | TIME_CTIME);
 	}
-	printf("RUFS initialized.\n");
-	return NULL;
+	return ret;
 }
 
-static void rufs_destroy(void *userdata) {
+// Sets the size of inode, freeing every block past the new end of file when it
+// shrinks. The caller holds the file's remap_lock exclusively from reading the
+// inode until it has written it back, then queues the trees listed in detached,
+// which are left to the reclaimer when a lot is cut off.
+static int truncate_inode(struct inode *inode, off_t size, struct reclaim_job **detached) {
+	if (size < 0) {
+		return -EINVAL;
+	}
+	if (size > UINT32_MAX) {
+		return -EFBIG;
+	}
+	if (size < inode->size) {
+		// the cluster holding the new EOF is no longer complete, keep it as plain blocks
+		if ((inode->flags & INODE_COMPRESSED) && size % CLUSTER_SIZE != 0) {
+			int ret = cluster_expand(inode, size / CLUSTER_SIZE);
+			if (ret < 0) {
+				return ret;
+			}
+		}
+		// zero the tail of the new last block, so growing the file again reads zeros
+		if (size % BLOCK_SIZE != 0) {
+			int pblk = bmap(inode, size / BLOCK_SIZE, NULL);
+			if (PTR_HAS_DATA(pblk)) {
+				pblk = bmap_unshare(inode, size / BLOCK_SIZE, pblk, 1);
+				if (pblk == -1) {
+					return -ENOSPC;
+				}
+				char block[BLOCK_SIZE];
+				cache_read(pblk, block);
+				memset(block + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+				cache_write_ino(pblk, block, inode->ino);
+			}
+		}
+		int defer = (inode->size - size) / BLOCK_SIZE > RECLAIM_DEFER_BLOCKS;
+		bmap_unmap(inode, (size + BLOCK_SIZE - 1) / BLOCK_SIZE, INT_MAX, defer ? detached : NULL);
+	}
+	inode->size = size;
+	return 0;
+}
 
-	// Step 1: De-allocate in-memory data structures
-	free(superblock);
-	free(inode_bitmap);
-	free(data_block_bitmap);
-	// Step 2: Close diskfile
-	dev_close();
+static int rufs_truncate(const char *path, off_t size) {
+	struct inode inode;
+	if (get_node_by_path(path, 0, &inode) == -1) {
+		return -ENOENT;
+	}
+	// the block map may have changed before the lock was taken
+	pthread_rwlock_wrlock(&remap_lock[inode.ino]);
+	readi(inode.ino, &inode);
+	struct reclaim_job *detached = NULL;
+	int ret = truncate_inode(&inode, size, &detached);
+	if (ret == 0) {
+		inode_touch(&inode, TIME_MTIME | TIME_CTIME);
+		writei(inode.ino, &inode);
+	}
+	reclaim_enqueue_detached(detached);
+	pthread_rwlock_unlock(&remap_lock[inode.ino]);
+	return ret;
+}
 
+static int rufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	// the inode number was saved in fi->fh by open/create
+	struct inode inode;
+	pthread_rwlock_wrlock(&remap_lock[fi->fh]);
+	readi(fi->fh, &inode);
+	struct reclaim_job *detached = NULL;
+	int ret = truncate_inode(&inode, size, &detached);
+	if (ret == 0) {
+		inode_touch(&inode, TIME_MTIME | TIME_CTIME);
+		writei(inode.ino, &inode);
+	}
+	reclaim_enqueue_detached(detached);
+	pthread_rwlock_unlock(&remap_lock[fi->fh]);
+	return ret;
 }
 
-static int rufs_getattr(const char *path, struct stat *stbuf) {
+static int rufs_release(const char *path, struct fuse_file_info *fi) {
+	// clusters that partial writes left plain are compressed once per close
+	cluster_recompress(fi->fh);
+	inode_release(fi->fh);
+	return 0;
+}
 
-	// Step 1: call get_node_by_path() to get inode from path
-	struct inode *inode = malloc(sizeof(struct inode));
-	if (get_node_by_path(path, 0, inode) == -1) {
-		printf("Invalid path.\n");
+static int rufs_flush(const char * path, struct fuse_file_info * fi) {
+	// close() does not promise durability, but in ordered mode the file's
+	// data and metadata are started on their way to the device here
+	if (durability == DURABILITY_ORDERED) {
+		times_flush(fi->fh, 1);
+		cache_writeback(FLUSH_INODE, fi->fh);
+	}
+    return 0;
+}
+
+static int rufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	// the inode number was saved in fi->fh by open/create. datasync leaves the
+	// pending times out; the inode block still goes when the size or block map
+	// changed it, as the data can't be found without those.
+	if (!datasync) {
+		times_flush(fi->fh, 1);
+	}
+	return cache_sync_inode(fi->fh);
+}
+
+static int rufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+	struct inode dir_inode;
+	if (get_node_by_path(path, 0, &dir_inode) < 0) {
 		return -ENOENT;
 	}
-	// Step 2: fill attribute of file into stbuf from inode
-	if (inode->ino == 0) { // if root directory
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-	} else { // if other directories
-		stbuf->st_mode = inode->type | 0755;
-		stbuf->st_nlink = inode->link;
+	times_flush(dir_inode.ino, 1);
+	return cache_sync_inode(dir_inode.ino);
+}
+
+static int rufs_utimens(const char *path, const struct timespec tv[2]) {
+	struct inode inode;
+	if (get_node_by_path(path, 0, &inode) == -1) {
+		return -ENOENT;
+	}
+	// The times go through the lazy times table like any other, so only they
+	// change and the rest of the inode is left to whoever holds it. Explicit
+	// times may go back, so they replace the inode's rather than merge.
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct timespec times[3] = { now, now, now };
+	int which = TIME_CTIME | TIME_REPLACE;
+	for (int i = 0; i < 2; i++) {
+		if (tv != NULL && tv[i].tv_nsec == UTIME_OMIT) {
+			continue;
+		}
+		which |= i == 0 ? TIME_ATIME : TIME_MTIME;
+		if (tv != NULL && tv[i].tv_nsec != UTIME_NOW) {
+			times[i] = tv[i];
+		}
+	}
+	times_set(inode.ino, which, times);
+	return 0;
+}
+
+
+// SEEK_DATA/SEEK_HOLE from offset, returns the new offset or -ENXIO
+static off_t rufs_seek(struct inode *inode, off_t offset, int data) {
+	if (offset < 0 || offset >= inode->size) {
+		return -ENXIO;
+	}
+	int lblk = bmap_seek(inode, offset / BLOCK_SIZE, data);
+	if (inode->flags & INODE_COMPRESSED) {
+		// the unmapped tail entries of a compressed cluster are data, not a hole
+		if (data && cluster_is_compressed(inode, offset / CLUSTER_SIZE)) {
+			lblk = offset / BLOCK_SIZE;
+		}
+		while (!data && lblk != -1 && cluster_is_compressed(inode, lblk / CLUSTER_BLOCKS)) {
+			lblk = bmap_seek(inode, (lblk / CLUSTER_BLOCKS + 1) * CLUSTER_BLOCKS, 0);
+		}
+	}
+	off_t found = (off_t)lblk * BLOCK_SIZE;
+	if (found < offset) {
+		found = offset;
+	}
+	if (data) {
+		return (lblk == -1 || found >= inode->size) ? -ENXIO : found;
+	}
+	// there is always an implicit hole at the end of the file
+	return (lblk == -1 || found > inode->size) ? inode->size : found;
+}
+
+// Makes [dst_off, dst_off + len) of dst share the data blocks of [src_off, src_off + len)
+// of src, copy-on-write; len 0 means up to EOF of src. The offsets have to be block
+// aligned, cluster aligned for compressed files, and so does len unless the range
+// ends at EOF of src and reaches EOF of dst. The caller writes dst back.
+static int reflink_range(struct inode *src, off_t src_off, struct inode *dst, off_t dst_off, off_t len) {
+	if (S_ISDIR(src->type) || S_ISDIR(dst->type)) {
+		return -EISDIR;
+	}
+	if (src->ino == dst->ino || ((src->flags ^ dst->flags) & INODE_COMPRESSED)) {
+		return -EINVAL;
+	}
+	if (src_off < 0 || dst_off < 0 || len < 0 || src_off > src->size) {
+		return -EINVAL;
+	}
+	if (len == 0) {
+		len = src->size - src_off;
+	}
+	if (src_off + len > src->size) {
+		return -EINVAL;
+	}
+	if (dst_off + len > UINT32_MAX) {
+		return -EFBIG;
+	}
+	int align = (src->flags & INODE_COMPRESSED) ? CLUSTER_SIZE : BLOCK_SIZE;
+	int tail = len % align != 0;
+	if (src_off % align != 0 || dst_off % align != 0
+			|| (tail && (src_off + len != src->size || dst_off + len < dst->size))) {
+		return -EINVAL;
+	}
+	if (len == 0) {
+		return 0;
+	}
+	// shared blocks are never written in place, so write back what src has dirty now
+	cache_writeback(FLUSH_INODE, src->ino);
+	int first = src_off / BLOCK_SIZE;
+	int count = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int dst_first = dst_off / BLOCK_SIZE;
+	int *ptrs = malloc(sizeof(int) * count);
+	int *old = malloc(sizeof(int) * count);
+	int ret = 0;
+	// Step 1: Take a reference on every source block, dst is not touched before
+	// they are all held
+	int i;
+	for (i = 0; i < count; i++) {
+		ptrs[i] = bmap(src, first + i, NULL);
+		if (!PTR_HAS_DATA(ptrs[i])) { // holes and unwritten blocks stay holes
+			ptrs[i] = -1;
+		} else if (block_ref(PTR_BLKNO(ptrs[i])) == -1) {
+			ret = -EMLINK;
+			break;
+		}
+	}
+	if (ret < 0) {
+		while (i-- > 0) {
+			if (ptrs[i] != -1) {
+				free_blkno(PTR_BLKNO(ptrs[i]));
+			}
+		}
+		free(old);
+		free(ptrs);
+		return ret;
+	}
+	// Step 2: Map them over the blocks of dst, which stay allocated until every
+	// entry is in, so a pointer block that can't be allocated is rolled back
+	bmap_cache_invalidate(dst->ino);
+	zcache_invalidate(dst->ino);
+	for (i = 0; i < count; i++) {
+		old[i] = bmap(dst, dst_first + i, NULL);
+	}
+	for (i = 0; i < count; i++) {
+		if (ptrs[i] != -1 && bmap_set(dst, dst_first + i, ptrs[i]) == -1) {
+			ret = -ENOSPC;
+			break;
+		}
+	}
+	if (ret < 0) {
+		for (int j = 0; j < count; j++) {
+			if (ptrs[j] == -1) {
+				continue;
+			}
+			if (j < i && old[j] == -1) {
+				// unmapping drops the reference and any pointer block it needed
+				bmap_unmap(dst, dst_first + j, dst_first + j, NULL);
+				continue;
+			}
+			if (j < i) {
+				bmap_set(dst, dst_first + j, old[j]);
+			}
+			free_blkno(PTR_BLKNO(ptrs[j]));
+		}
+		free(old);
+		free(ptrs);
+		return ret;
+	}
+	// Step 3: Free what dst had there, source holes become holes in dst
+	struct block_batch batch = { NULL, 0, 0 };
+	for (i = 0; i < count; i++) {
+		if (ptrs[i] != -1 && old[i] != -1) {
+			batch_add(&batch, PTR_BLKNO(old[i]));
+		}
+	}
+	batch_release_unmapped(&batch);
+	for (i = 0; i < count; i++) {
+		if (ptrs[i] != -1 || old[i] == -1) {
+			continue;
+		}
+		int run = i;
+		while (run + 1 < count && ptrs[run + 1] == -1) {
+			run++;
+		}
+		bmap_unmap(dst, dst_first + i, dst_first + run, NULL);
+		i = run;
+	}
+	// with a partial last block everything after the range is past EOF of dst
+	if (tail) {
+		bmap_unmap(dst, dst_first + count, INT_MAX, NULL);
+	}
+	free(old);
+	free(ptrs);
+	if (dst_off + len > dst->size) {
+		dst->size = dst_off + len;
+	}
+	return 0;
+}
+
+// Counts the runs of contiguous blocks among n block pointers
+static int count_extents(const int *ptrs, int n) {
+	int extents = 0;
+	for (int i = 0; i < n; i++) {
+		if (i == 0 || PTR_BLKNO(ptrs[i]) != PTR_BLKNO(ptrs[i - 1]) + 1) {
+			extents++;
+		}
+	}
+	return extents;
+}
+
+// Moves the data blocks of file ino into as few contiguous runs as the allocator
+// can hand out. Blocks shared with reflinked files and unwritten ones stay put.
+// The new copies are written before the block map is switched over to them, so
+// the file reads the same at every point; its readers and writers wait on its
+// remap_lock meanwhile. The old blocks are freed once spliced reads that may still
+// point at them are done.
+static int defrag_file(uint16_t ino, struct rufs_defrag_stats *stats) {
+	memset(stats, 0, sizeof(struct rufs_defrag_stats));
+	pthread_rwlock_wrlock(&remap_lock[ino]);
+	struct inode inode;
+	readi(ino, &inode);
+	// unlinked and reclaimed since the caller looked it up
+	if (!inode.valid || inode.link == 0) {
+		pthread_rwlock_unlock(&remap_lock[ino]);
+		return -ENOENT;
+	}
+	int n = 0, capacity = 256;
+	int *lblks = malloc(sizeof(int) * capacity);
+	int *ptrs = malloc(sizeof(int) * capacity);
+	for (int lblk = bmap_seek(&inode, 0, 1); lblk != -1; lblk = bmap_seek(&inode, lblk + 1, 1)) {
+		if (n == capacity) {
+			capacity *= 2;
+			lblks = realloc(lblks, sizeof(int) * capacity);
+			ptrs = realloc(ptrs, sizeof(int) * capacity);
+		}
+		lblks[n] = lblk;
+		ptrs[n++] = bmap(&inode, lblk, NULL);
+	}
+	stats->extents_before = count_extents(ptrs, n);
+	stats->extents_after = stats->extents_before;
+	int movable = 0;
+	for (int i = 0; i < n; i++) {
+		if (!block_is_shared(PTR_BLKNO(ptrs[i]))) {
+			movable++;
+		}
+	}
+	// take the new runs first, and give them back unless they are fewer
+	struct block_batch batch = { NULL, 0, 0 };
+	int runs = 0;
+	while (batch.count < movable && runs < (int)stats->extents_before) {
+		int run_len;
+		int run = get_avail_blkno_run(movable - batch.count, &run_len);
+		if (run == -1) {
+			break;
+		}
+		for (int i = 0; i < run_len; i++) {
+			batch_add(&batch, run + i);
+		}
+		runs++;
+	}
+	if (movable == 0 || batch.count < movable || runs >= (int)stats->extents_before) {
+		batch_release(&batch);
+	} else {
+		char block[BLOCK_SIZE];
+		int next = 0;
+		int *new_ptrs = malloc(sizeof(int) * n);
+		for (int i = 0; i < n; i++) {
+			new_ptrs[i] = ptrs[i];
+			if (block_is_shared(PTR_BLKNO(ptrs[i]))) {
+				continue;
+			}
+			new_ptrs[i] = batch.blocks[next++] | (ptrs[i] & COMPRESSED_FLAG);
+			cache_read(PTR_BLKNO(ptrs[i]), block);
+			cache_write_ino(PTR_BLKNO(new_ptrs[i]), block, ino);
+		}
+		// every entry is mapped already, so switching them allocates nothing
+		batch.count = 0;
+		for (int i = 0; i < n; i++) {
+			if (new_ptrs[i] != ptrs[i]) {
+				bmap_set(&inode, lblks[i], new_ptrs[i]);
+				batch_add(&batch, PTR_BLKNO(ptrs[i]));
+			}
+		}
+		// lazy times may have been folded into the inode block since it was read
+		struct inode now;
+		readi(ino, &now);
+		inode.vstat = now.vstat;
+		writei(ino, &inode);
+		stats->blocks_moved = batch.count;
+		stats->extents_after = count_extents(new_ptrs, n);
+		batch_release_unmapped(&batch);
+		free(new_ptrs);
+	}
+	pthread_rwlock_unlock(&remap_lock[ino]);
+	free(lblks);
+	free(ptrs);
+	return 0;
+}
+
+// Packs the entries of directory ino into its first blocks and frees the blocks
+// left empty. Block 0 is always kept. The Bloom filter is rebuilt on the way.
+static int defrag_dir(uint16_t ino, struct rufs_defrag_stats *stats) {
+	memset(stats, 0, sizeof(struct rufs_defrag_stats));
+	pthread_mutex_lock(&dir_lock);
+	struct inode dir;
+	readi(ino, &dir);
+	struct dirent_block *blocks = malloc(sizeof(struct dirent_block) * DIRECT_PTRS);
+	int entries = 0;
+	for (int i = 0; i < DIRECT_PTRS; i++) {
+		if (dir.direct_ptr[i] == -1) {
+			continue;
+		}
+		stats->extents_before++;
+		cache_read(dir.direct_ptr[i], &blocks[i]);
+		for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+			entries += blocks[i].hash[j] != 0;
+		}
+	}
+	int needed = (entries + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK;
+	if (needed < 1) {
+		needed = 1;
+	}
+	if (needed >= (int)stats->extents_before) { // nothing to gain
+		stats->extents_after = stats->extents_before;
+		pthread_mutex_unlock(&dir_lock);
+		free(blocks);
+		return 0;
+	}
+	__atomic_add_fetch(&dir_moves, 1, __ATOMIC_ACQ_REL);
+	struct dirent_block packed;
+	memset(&packed, 0, sizeof(packed));
+	uint8_t bloom[DIR_BLOOM_BYTES];
+	memset(bloom, 0, DIR_BLOOM_BYTES);
+	int out = 0; // next block to fill
+	int filled = 0;
+	for (int i = 0; i < DIRECT_PTRS; i++) {
+		if (dir.direct_ptr[i] == -1) {
+			continue;
+		}
+		for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+			if (blocks[i].hash[j] == 0) {
+				continue;
+			}
+			packed.hash[filled] = blocks[i].hash[j];
+			packed.entries[filled] = blocks[i].entries[j];
+			bloom_add(bloom, blocks[i].hash[j]);
+			if (++filled == DIRENTS_PER_BLOCK) {
+				while (dir.direct_ptr[out] == -1) {
+					out++;
+				}
+				cache_write_ino(dir.direct_ptr[out++], &packed, ino);
+				memset(&packed, 0, sizeof(packed));
+				filled = 0;
+			}
+		}
+	}
+	int kept = 0;
+	for (int i = 0; i < DIRECT_PTRS; i++) {
+		if (dir.direct_ptr[i] == -1 || i < out) {
+			kept += dir.direct_ptr[i] != -1;
+			continue;
+		}
+		if (filled > 0 || (kept == 0 && i == 0)) { // the last, partly filled block
+			cache_write_ino(dir.direct_ptr[i], &packed, ino);
+			memset(&packed, 0, sizeof(packed));
+			filled = 0;
+			kept++;
+		} else if (i != 0) {
+			free_blkno(dir.direct_ptr[i]);
+			dir.direct_ptr[i] = -1;
+		}
 	}
-	stbuf->st_atime = inode->vstat.st_atime;
-	stbuf->st_blksize = inode->vstat.st_blksize;
-	stbuf->st_blocks = inode->vstat.st_blocks;
-	stbuf->st_ctime = inode->vstat.st_ctime;
-	stbuf->st_dev = inode->vstat.st_dev;
-	stbuf->st_gid = getgid();
-	stbuf->st_ino = inode->vstat.st_ino;
-	stbuf->st_mtime = inode->vstat.st_mtime;
-	stbuf->st_rdev = inode->vstat.st_rdev;
-	stbuf->st_size = inode->size;
-	stbuf->st_uid = getuid();
-	
-	free(inode);
-
+	writei(ino, &dir);
+	dir_bloom_store(&dir, bloom);
+	__atomic_add_fetch(&dir_moves, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_unlock(&dir_lock);
+	stats->extents_after = kept;
+	stats->blocks_moved = stats->extents_before - kept;
+	free(blocks);
 	return 0;
 }
 
-static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
-
-	// Step 1: Call get_node_by_path() to get inode from path
+static int rufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
 	struct inode inode;
-	// Step 2: If not find, return -1
 	if (get_node_by_path(path, 0, &inode) == -1) {
-		printf("Invalid path.\n");
-		return -1;
-	} else {
+		return -ENOENT;
+	}
+	switch ((unsigned int)cmd) {
+	case RUFS_IOC_SEEK_DATA:
+	case RUFS_IOC_SEEK_HOLE: {
+		off_t ret = rufs_seek(&inode, *(int64_t *)data, (unsigned int)cmd == RUFS_IOC_SEEK_DATA);
+		if (ret < 0) {
+			return ret;
+		}
+		*(int64_t *)data = ret;
+		return 0;
+	}
+	case RUFS_IOC_FRAG_STATS:
+		buddy_stats(data);
 		return 0;
+	case RUFS_IOC_DEFRAG:
+		if (S_ISDIR(inode.type)) {
+			return defrag_dir(inode.ino, data);
+		}
+		return defrag_file(inode.ino, data);
+	case RUFS_IOC_CLONE_RANGE: {
+		struct rufs_clone_range *args = data;
+		args->src_path[PATH_MAX - 1] = '\0';
+		struct inode src;
+		if (get_node_by_path(args->src_path, 0, &src) == -1) {
+			return -ENOENT;
+		}
+		if (src.ino == inode.ino) {
+			return -EINVAL;
+		}
+		// the source's blocks must not move while their references are taken.
+		// The lower inode number is locked first, so clones both ways can't deadlock.
+		if (src.ino < inode.ino) {
+			pthread_rwlock_rdlock(&remap_lock[src.ino]);
+			pthread_rwlock_wrlock(&remap_lock[inode.ino]);
+		} else {
+			pthread_rwlock_wrlock(&remap_lock[inode.ino]);
+			pthread_rwlock_rdlock(&remap_lock[src.ino]);
+		}
+		readi(inode.ino, &inode);
+		readi(src.ino, &src);
+		int ret = reflink_range(&src, args->src_offset, &inode, args->dest_offset, args->src_length);
+		if (ret == 0) {
+			writei(inode.ino, &inode);
+		}
+		pthread_rwlock_unlock(&remap_lock[src.ino]);
+		pthread_rwlock_unlock(&remap_lock[inode.ino]);
+		return ret;
+	}
+	default:
+		return -ENOTTY;
 	}
 }
 
-// ls command
-static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	printf("--LS--\n");
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode inode;
-	if (get_node_by_path(path, 0, &inode) == -1) {
-		printf("Invalid path.\n");
-		return -1;
-	}
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
-	int entries_per_block = BLOCK_SIZE / sizeof(struct dirent);
+// Zeroes [offset, offset + len) of the file: whole blocks are unmapped and freed,
+// the partial blocks at either end are zeroed in place
+static int punch_hole(struct inode *inode, off_t offset, off_t len) {
+	// blocks preallocated past EOF are released too, so the range is not clamped to the size
+	off_t end = offset + len;
 	char block[BLOCK_SIZE];
+	if (inode->flags & INODE_COMPRESSED) {
+		// clusters only partly inside the range are zeroed block by block
+		int ret = 0;
+		if (offset % CLUSTER_SIZE != 0 || len < CLUSTER_SIZE) {
+			ret = cluster_expand(inode, offset / CLUSTER_SIZE);
+		}
+		if (ret >= 0 && end % CLUSTER_SIZE != 0) {
+			ret = cluster_expand(inode, end / CLUSTER_SIZE);
+		}
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	int first_full = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int last_full = end / BLOCK_SIZE - 1;
+	if (first_full > last_full) { // the range sits inside a single block
+		int pblk = bmap(inode, offset / BLOCK_SIZE, NULL);
+		if (PTR_HAS_DATA(pblk)) {
+			if ((pblk = bmap_unshare(inode, offset / BLOCK_SIZE, pblk, 1)) == -1) {
+				return -ENOSPC;
+			}
+			cache_read(pblk, block);
+			memset(block + offset % BLOCK_SIZE, 0, end - offset);
+			cache_write_ino(pblk, block, inode->ino);
+		}
+		return 0;
+	}
+	if (offset % BLOCK_SIZE != 0) {
+		int pblk = bmap(inode, offset / BLOCK_SIZE, NULL);
+		if (PTR_HAS_DATA(pblk)) {
+			if ((pblk = bmap_unshare(inode, offset / BLOCK_SIZE, pblk, 1)) == -1) {
+				return -ENOSPC;
+			}
+			cache_read(pblk, block);
+			memset(block + offset % BLOCK_SIZE, 0, BLOCK_SIZE - offset % BLOCK_SIZE);
+			cache_write_ino(pblk, block, inode->ino);
+		}
+	}
+	if (end % BLOCK_SIZE != 0) {
+		int pblk = bmap(inode, end / BLOCK_SIZE, NULL);
+		if (PTR_HAS_DATA(pblk)) {
+			if ((pblk = bmap_unshare(inode, end / BLOCK_SIZE, pblk, 1)) == -1) {
+				return -ENOSPC;
+			}
+			cache_read(pblk, block);
+			memset(block, 0, end % BLOCK_SIZE);
+			cache_write_ino(pblk, block, inode->ino);
+		}
+	}
+	bmap_unmap(inode, first_full, last_full, NULL);
+	return 0;
+}
 
-	for (int i = 0; i < 16; i++) {
-		if (inode.direct_ptr[i] != -1) {
-			bio_read(inode.direct_ptr[i], block);
-			struct dirent* entry = (struct dirent*)block;
-			for (int j = 0; j < entries_per_block; j++) {
-				if (entry->valid) {
-					filler(buffer, entry->name, NULL, 0);
+// Returns whether lblk is a hole for preallocation to fill; the unmapped tail
+// entries of a compressed cluster are not
+static int prealloc_hole(struct inode *inode, int lblk) {
+	if (bmap(inode, lblk, NULL) != -1) {
+		return 0;
+	}
+	return !(inode->flags & INODE_COMPRESSED) || !cluster_is_compressed(inode, lblk / CLUSTER_BLOCKS);
+}
+
+// Reserves blocks for every hole in [offset, offset + len) as unwritten, taking
+// them from the allocator in as few contiguous runs as free space allows
+static int preallocate(struct inode *inode, off_t offset, off_t len) {
+	int first = offset / BLOCK_SIZE;
+	int last = (offset + len - 1) / BLOCK_SIZE;
+	int holes = 0;
+	for (int lblk = first; lblk <= last; lblk++) {
+		if (prealloc_hole(inode, lblk)) {
+			holes++;
+		}
+	}
+	int lblk = first;
+	while (holes > 0) {
+		int run_len = 0;
+		int run = get_avail_blkno_run(holes, &run_len);
+		if (run == -1) {
+			return -ENOSPC;
+		}
+		for (int i = 0; i < run_len; lblk++) {
+			if (!prealloc_hole(inode, lblk)) {
+				continue;
+			}
+			if (bmap_set(inode, lblk, (run + i) | UNWRITTEN_FLAG) == -1) {
+				// out of space for pointer blocks, give back what is left of the run
+				for (; i < run_len; i++) {
+					free_blkno(run + i);
 				}
-				entry++;
+				return -ENOSPC;
 			}
+			i++;
 		}
+		holes -= run_len;
 	}
 	return 0;
 }
 
-
-static int rufs_mkdir(const char *path, mode_t mode) {
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	// Duplicate path to avoid modifications by dirname and basename
-	printf("--RUFS_MKDIR--\n");
-  char *path_dup = strdup(path);
-  char *path_base = strdup(path);
-  char *directory_name = dirname(path_dup);
-  char *base_name = basename(path_base);
-	printf("DIRECTORY NAME: %s\n", directory_name);
-	printf("BASE_NAME: %s\n", base_name);
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode inode;
-	if (get_node_by_path(directory_name, 0, &inode) == -1) {
-		printf("Path invalid.\n");
-		free(path_dup);
-		free(path_base);
-		return -1;
+static int rufs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+	if (offset < 0 || len <= 0) {
+		return -EINVAL;
 	}
-	// get an available inode number
-	int available_inode_no = get_avail_ino();
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-	struct dirent dirent;
-	if (dir_find(inode.ino, base_name, strlen(base_name), &dirent) == 0) {
-		printf("Can't create because directory already exists.\n");
-		free(path_dup);
-		free(path_base);
-		return -1;
+	if (offset + len > UINT32_MAX) {
+		return -EFBIG;
 	}
-	// Add new directory entry
-	dir_add(inode, available_inode_no, base_name, strlen(base_name));
-	// Step 6: Call writei() to write inode to disk
-	struct inode* new_inode = malloc(sizeof(struct inode));
-	new_inode->ino = available_inode_no;
-	new_inode->valid = 1;
-	new_inode->size = BLOCK_SIZE;
-	new_inode->type = S_IFDIR | 0755;
-	new_inode->link = 2;
-	new_inode->direct_ptr[0] = get_avail_blkno();
-	
-	for (int i = 1; i < 16; i++) {
-		new_inode->direct_ptr[i] = -1;
+	if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE) && mode != 0 && mode != FALLOC_FL_KEEP_SIZE) {
+		return -EOPNOTSUPP;
 	}
-	for (int i = 0; i < 8; i++) {
-		new_inode->indirect_ptr[i] = -1;
+	struct inode inode;
+	if (get_node_by_path(path, 0, &inode) == -1) {
+		return -ENOENT;
 	}
-	writei(available_inode_no, new_inode);
-	free(new_inode);
-	free(path_dup);
-	free(path_base);
-
-	return 0;
+	// the block map may have changed before the lock was taken
+	pthread_rwlock_wrlock(&remap_lock[inode.ino]);
+	readi(inode.ino, &inode);
+	int ret = 0;
+	if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+		ret = punch_hole(&inode, offset, len);
+		if (ret == 0) { // the clusters expanded at either end can shrink again
+			cluster_compress_range(&inode, offset, len);
+		}
+	} else {
+		ret = preallocate(&inode, offset, len);
+		if (ret == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + len > inode.size) {
+			inode.size = offset + len;
+		}
+	}
+	writei(inode.ino, &inode);
+	pthread_rwlock_unlock(&remap_lock[inode.ino]);
+	return ret;
 }
 
-// Required for 518
-static int rufs_rmdir(const char *path) {
 
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+static struct fuse_operations rufs_ope = {
+	.init		= rufs_init,
+	.destroy	= rufs_destroy,
 
-	// Step 2: Call get_node_by_path() to get inode of target directory
+	.getattr	= rufs_getattr,
+	.statfs		= rufs_statfs,
+	.readdir	= rufs_readdir,
+	.opendir	= rufs_opendir,
+	.releasedir	= rufs_releasedir,
+	.mkdir		= rufs_mkdir,
+	.rmdir		= rufs_rmdir,
 
-	// Step 3: Clear data block bitmap of target directory
+	.create		= rufs_create,
+	.open		= rufs_open,
+	.read 		= rufs_read,
+	.write		= rufs_write,
+	.read_buf	= rufs_read_buf,
+	.write_buf	= rufs_write_buf,
+	.unlink		= rufs_unlink,
 
-	// Step 4: Clear inode bitmap and its data block
+	.truncate   = rufs_truncate,
+	.ftruncate  = rufs_ftruncate,
+	.flush      = rufs_flush,
+	.fsync		= rufs_fsync,
+	.fsyncdir	= rufs_fsyncdir,
+	.utimens    = rufs_utimens,
+	.release	= rufs_release,
 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
+	.ioctl		= rufs_ioctl,
+	.fallocate	= rufs_fallocate
+};
 
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
+/*
+ * traced callbacks, used instead of rufs_ope with -o trace=FILE
+ */
 
-	return 0;
-}
+// Runs call and records it to the trace with its latency and result
+#define TRACED(op, path, ino, offset, size, flags, call) \
+	uint64_t start = trace_now(); \
+	int ret = call; \
+	trace_record(op, path, ino, offset, size, flags, ret, start); \
+	return ret
 
-static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
-  // For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+static int traced_getattr(const char *path, struct stat *stbuf) {
+	TRACED(TRACE_GETATTR, path, 0, 0, 0, 0, rufs_getattr(path, stbuf));
 }
 
-static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	char* path_dup = strdup(path);
-	char* path_base = strdup(path);
-	char* directory_name = dirname(path_dup);
-	char* base_name = basename(path_base);
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode inode;
-	if (get_node_by_path(directory_name, 0, &inode) == -1) {
-		printf("Path invalid.\n");
-		free(path_dup);
-		free(path_base);
-		return -1;
-	}
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int available_inode_no = get_avail_ino();
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	struct dirent dirent;
-	if (dir_find(inode.ino, base_name, strlen(base_name), &dirent) == 0) {
-		printf("File already exists.\n");
-		free(path_dup);
-		free(path_base);
-		return -1;
-	}
-	// Step 5: Update inode for target file
-	// Add new directory entry
-	dir_add(inode, available_inode_no, base_name, strlen(base_name));
-	// Step 6: Call writei() to write inode to disk
-	struct inode* new_inode = malloc(sizeof(struct inode));
-	new_inode->ino = available_inode_no;
-	new_inode->valid = 1;
-	new_inode->size = BLOCK_SIZE;
-	new_inode->type = S_IFREG | 0644;
-	new_inode->link = 1;
-	new_inode->direct_ptr[0] = get_avail_blkno();
-	
-	for (int i = 1; i < 16; i++) {
-		new_inode->direct_ptr[i] = -1;
-	}
-	for (int i = 0; i < 8; i++) {
-		new_inode->indirect_ptr[i] = -1;
-	}
-	writei(available_inode_no, new_inode);
-	free(new_inode);
-	free(path_dup);
-	free(path_base);
-	return 0;
+static int traced_statfs(const char *path, struct statvfs *stbuf) {
+	TRACED(TRACE_STATFS, path, 0, 0, 0, 0, rufs_statfs(path, stbuf));
 }
 
-static int rufs_open(const char *path, struct fuse_file_info *fi) {
+static int traced_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	TRACED(TRACE_READDIR, path, 0, offset, 0, 0, rufs_readdir(path, buffer, filler, offset, fi));
+}
 
-	// Step 1: Call get_node_by_path() to get inode from path
-	// Step 2: If not find, return -1
-	struct inode inode;
-	if (get_node_by_path(path, 0, &inode) == -1) {
-		printf("Failed to open file.\n");
-		return -1;
-	}
-	return 0;
+static int traced_opendir(const char *path, struct fuse_file_info *fi) {
+	TRACED(TRACE_OPENDIR, path, 0, 0, 0, 0, rufs_opendir(path, fi));
 }
 
-static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+static int traced_releasedir(const char *path, struct fuse_file_info *fi) {
+	TRACED(TRACE_RELEASEDIR, path, 0, 0, 0, 0, rufs_releasedir(path, fi));
+}
 
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode inode;
-	get_node_by_path(path, 0, &inode);
-	int bytes_read = 0; // total bytes read
-	int bytes_to_read = 0; // bytes to read in block
-	int bytes_remaining = size; // total bytes remaining to read
-	int block_offset = 0;
-	int start_block = offset / BLOCK_SIZE;
-	int end_block = (offset + size) / BLOCK_SIZE;
-	char block[BLOCK_SIZE];
-	// Step 2: Based on size and offset, read its data blocks from disk
-	for (int i = start_block; i <= end_block; i++) {
-		if (inode.direct_ptr[i] != -1) {
-			bio_read(inode.direct_ptr[i], block);
-			if (bytes_read == 0) { // if starting
-				block_offset = offset % BLOCK_SIZE;
-			} else {
-				block_offset = 0;
-			}
-			if (bytes_remaining < BLOCK_SIZE) {
-				bytes_to_read = bytes_remaining;
-			} else {
-				bytes_to_read = BLOCK_SIZE - block_offset;
-			}
-			memcpy(buffer + bytes_read, block + block_offset, bytes_to_read);
-			bytes_read += bytes_to_read;
-			bytes_remaining -= bytes_to_read;
-		}
-	}
-	return bytes_read;
-	// Step 3: copy the correct amount of data from offset to buffer
-	// Note: this function should return the amount of bytes you copied to buffer
+static int traced_mkdir(const char *path, mode_t mode) {
+	TRACED(TRACE_MKDIR, path, 0, 0, 0, mode, rufs_mkdir(path, mode));
+}
 
+static int traced_rmdir(const char *path) {
+	TRACED(TRACE_RMDIR, path, 0, 0, 0, 0, rufs_rmdir(path));
 }
 
-static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	// Step 1: You could call get_node_by_path() to get inode from path
-	// Step 2: Based on size and offset, read its data blocks from disk
-	// Step 3: Write the correct amount of data from offset to disk
-	// Step 4: Update the inode info and write it to disk
+static int traced_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	TRACED(TRACE_CREATE, path, fi->fh, 0, 0, mode, rufs_create(path, mode, fi));
+}
 
-	// Note: this function should return the amount of bytes you write to disk
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode inode;
-	get_node_by_path(path, 0, &inode);
-	int bytes_written = 0; // total bytes read
-	int bytes_to_write = 0; // bytes to read in block
-	int bytes_remaining = size; // total bytes remaining to read
-	int block_offset = 0;
-	int start_block = offset / BLOCK_SIZE;
-	int end_block = (offset + size) / BLOCK_SIZE;
-	char block[BLOCK_SIZE];
-	// Step 2: Based on size and offset, read its data blocks from disk
-	for (int i = start_block; i <= end_block; i++) {
-		if (inode.direct_ptr[i] != -1) {
-			bio_read(inode.direct_ptr[i], block);
-			if (bytes_written == 0) { // if starting
-				block_offset = offset % BLOCK_SIZE;
-			} else {
-				block_offset = 0;
-			}
-			if (bytes_remaining < BLOCK_SIZE) {
-				bytes_to_write = bytes_remaining;
-			} else {
-				bytes_to_write = BLOCK_SIZE - block_offset;
-			}
-			memcpy(block + block_offset, buffer + bytes_written, bytes_to_write);
-			bytes_written += bytes_to_write;
-			bytes_remaining -= bytes_to_write;
-			bio_write(inode.direct_ptr[i], block);
-		}
-	}
-	return bytes_written;
-	// Step 3: copy the correct amount of data from offset to buffer
-	// Note: this function should return the amount of bytes you copied to buffer
+static int traced_open(const char *path, struct fuse_file_info *fi) {
+	TRACED(TRACE_OPEN, path, fi->fh, 0, 0, fi->flags, rufs_open(path, fi));
 }
 
-// Required for 518
+static int traced_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	TRACED(TRACE_READ, path, fi->fh, offset, size, 0, rufs_read(path, buffer, size, offset, fi));
+}
 
-static int rufs_unlink(const char *path) {
+static int traced_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	TRACED(TRACE_WRITE, path, fi->fh, offset, size, 0, rufs_write(path, buffer, size, offset, fi));
+}
 
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
+static int traced_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	TRACED(TRACE_READ_BUF, path, fi->fh, offset, size, 0, rufs_read_buf(path, bufp, size, offset, fi));
+}
 
-	// Step 2: Call get_node_by_path() to get inode of target file
+static int traced_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	TRACED(TRACE_WRITE_BUF, path, fi->fh, offset, fuse_buf_size(buf), 0, rufs_write_buf(path, buf, offset, fi));
+}
 
-	// Step 3: Clear data block bitmap of target file
+static int traced_unlink(const char *path) {
+	TRACED(TRACE_UNLINK, path, 0, 0, 0, 0, rufs_unlink(path));
+}
 
-	// Step 4: Clear inode bitmap and its data block
+static int traced_truncate(const char *path, off_t size) {
+	TRACED(TRACE_TRUNCATE, path, 0, size, 0, 0, rufs_truncate(path, size));
+}
 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
+static int traced_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	TRACED(TRACE_FTRUNCATE, path, fi->fh, size, 0, 0, rufs_ftruncate(path, size, fi));
+}
 
-	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
+static int traced_flush(const char *path, struct fuse_file_info *fi) {
+	TRACED(TRACE_FLUSH, path, fi->fh, 0, 0, 0, rufs_flush(path, fi));
+}
 
-	return 0;
+static int traced_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	TRACED(TRACE_FSYNC, path, fi->fh, 0, 0, datasync, rufs_fsync(path, datasync, fi));
 }
 
-static int rufs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+static int traced_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+	TRACED(TRACE_FSYNCDIR, path, 0, 0, 0, datasync, rufs_fsyncdir(path, datasync, fi));
 }
 
-static int rufs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
+static int traced_utimens(const char *path, const struct timespec tv[2]) {
+	TRACED(TRACE_UTIMENS, path, 0, 0, 0, 0, rufs_utimens(path, tv));
 }
 
-static int rufs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+static int traced_release(const char *path, struct fuse_file_info *fi) {
+	TRACED(TRACE_RELEASE, path, fi->fh, 0, 0, 0, rufs_release(path, fi));
 }
 
-static int rufs_utimens(const char *path, const struct timespec tv[2]) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+static int traced_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+	TRACED(TRACE_IOCTL, path, fi->fh, 0, 0, cmd, rufs_ioctl(path, cmd, arg, fi, flags, data));
 }
 
+static int traced_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+	TRACED(TRACE_FALLOCATE, path, fi->fh, offset, len, mode, rufs_fallocate(path, mode, offset, len, fi));
+}
 
-static struct fuse_operations rufs_ope = {
+static struct fuse_operations rufs_traced_ope = {
 	.init		= rufs_init,
 	.destroy	= rufs_destroy,
 
-	.getattr	= rufs_getattr,
-	.readdir	= rufs_readdir,
-	.opendir	= rufs_opendir,
-	.releasedir	= rufs_releasedir,
-	.mkdir		= rufs_mkdir,
-	.rmdir		= rufs_rmdir,
+	.getattr	= traced_getattr,
+	.statfs		= traced_statfs,
+	.readdir	= traced_readdir,
+	.opendir	= traced_opendir,
+	.releasedir	= traced_releasedir,
+	.mkdir		= traced_mkdir,
+	.rmdir		= traced_rmdir,
 
-	.create		= rufs_create,
-	.open		= rufs_open,
-	.read 		= rufs_read,
-	.write		= rufs_write,
-	.unlink		= rufs_unlink,
+	.create		= traced_create,
+	.open		= traced_open,
+	.read 		= traced_read,
+	.write		= traced_write,
+	.read_buf	= traced_read_buf,
+	.write_buf	= traced_write_buf,
+	.unlink		= traced_unlink,
 
-	.truncate   = rufs_truncate,
-	.flush      = rufs_flush,
-	.utimens    = rufs_utimens,
-	.release	= rufs_release
+	.truncate   = traced_truncate,
+	.ftruncate  = traced_ftruncate,
+	.flush      = traced_flush,
+	.fsync		= traced_fsync,
+	.fsyncdir	= traced_fsyncdir,
+	.utimens    = traced_utimens,
+	.release	= traced_release,
+
+	.ioctl		= traced_ioctl,
+	.fallocate	= traced_fallocate
 };
 
 
 int main(int argc, char *argv[]) {
 	int fuse_stat;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	getcwd(diskfile_path, PATH_MAX);
 	strcat(diskfile_path, "/DISKFILE");
 
-	fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+	if (fuse_opt_parse(&args, &options, rufs_opts, NULL) == -1) {
+		return 1;
+	}
+	if (options.ram) {
+		dev_set_backend(DEV_BACKEND_RAM, options.snapshot);
+	} else if (options.stripe != NULL && dev_set_stripe(options.stripe, options.stripe_unit) == -1) {
+		return 1;
+	}
+	if (options.durability != NULL) {
+		if (strcmp(options.durability, "sync") == 0) {
+			durability = DURABILITY_SYNC;
+		} else if (strcmp(options.durability, "ordered") == 0) {
+			durability = DURABILITY_ORDERED;
+		} else if (strcmp(options.durability, "writeback") == 0) {
+			durability = DURABILITY_WRITEBACK;
+		} else {
+			fprintf(stderr, "rufs: unknown durability mode %s\n", options.durability);
+			return 1;
+		}
+	}
+	if (options.atime != NULL) {
+		if (strcmp(options.atime, "relatime") == 0) {
+			atime_policy = ATIME_RELATIME;
+		} else if (strcmp(options.atime, "strictatime") == 0) {
+			atime_policy = ATIME_STRICT;
+		} else if (strcmp(options.atime, "noatime") == 0) {
+			atime_policy = ATIME_NOATIME;
+		} else {
+			fprintf(stderr, "rufs: unknown atime policy %s\n", options.atime);
+			return 1;
+		}
+	}
+	if (options.cache_blocks <= 0) {
+		fprintf(stderr, "rufs: cache_blocks must be at least 1\n");
+		return 1;
+	}
+	if (options.dirty_ratio <= 0 || options.dirty_ratio > 100 || options.dirty_background_ratio < 0
+			|| options.dirty_background_ratio > options.dirty_ratio) {
+		fprintf(stderr, "rufs: need 0 <= dirty_background_ratio <= dirty_ratio <= 100 and dirty_ratio > 0\n");
+		return 1;
+	}
+	if (options.trace != NULL) {
+		// fuse_main() changes to / when it daemonizes, so the path has to be absolute
+		if (options.trace[0] != '/') {
+			getcwd(trace_path, PATH_MAX);
+			strncat(trace_path, "/", PATH_MAX - strlen(trace_path) - 1);
+			strncat(trace_path, options.trace, PATH_MAX - strlen(trace_path) - 1);
+			options.trace = trace_path;
+		}
+		// refuse the mount now rather than from rufs_init()
+		FILE *trace_file = fopen(options.trace, "w");
+		if (trace_file == NULL) {
+			perror(options.trace);
+			return 1;
+		}
+		fclose(trace_file);
+	}
+	dev_set_sync(durability == DURABILITY_SYNC);
+	dev_set_direct(options.direct);
+	dev_set_discard(options.discard);
+
+	fuse_stat = fuse_main(args.argc, args.argv, options.trace != NULL ? &rufs_traced_ope : &rufs_ope, NULL);
+	fuse_opt_free_args(&args);
 
 	return fuse_stat;
 }
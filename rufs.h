@@ -8,14 +8,93 @@
 
 #include <linux/limits.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
+#define MAGIC_NUM 0x5C3B
 #define MAX_INUM 1024
 #define MAX_DNUM 8192
+#define DIRENT_NAME_LEN 208		/* names are NUL terminated, so at most 207 bytes */
+// Free data blocks are indexed as buddy runs of 2^k blocks, k < BUDDY_ORDERS
+#define BUDDY_ORDERS 14
+// Blocks holding a 16-bit reference count per data block, see block_refs
+#define REFCOUNT_BLOCKS ((MAX_DNUM * sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+// Inode table blocks are zeroed lazily, this many at a time
+#define ITABLE_INIT_CHUNK 8
+// Inode numbers and data blocks each thread reserves at a time, see struct magazine
+#define INO_MAGAZINE 8
+#define BLK_MAGAZINE 32
+
+// Block map geometry: 16 direct pointers, then indirect_ptr[0..5] are single
+// indirect, indirect_ptr[6] is double indirect and indirect_ptr[7] is triple
+#define DIRECT_PTRS 16
+#define INDIRECT_PTRS 8
+#define SINGLE_INDIRECT_PTRS 6
+#define DOUBLE_INDIRECT_SLOT 6
+#define TRIPLE_INDIRECT_SLOT 7
+#define PTRS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(int)))
+
+// Set in a block pointer whose block was reserved by fallocate but never written,
+// such blocks read back as zeros and are converted by their first write
+#define UNWRITTEN_FLAG 0x40000000
+// Set in the pointers of a compressed cluster: its CLUSTER_BLOCKS logical blocks are
+// stored as one LZ4 stream in the blocks of its first entries, the rest are unmapped
+#define COMPRESSED_FLAG 0x20000000
+#define PTR_BLKNO(p) ((p) & ~(UNWRITTEN_FLAG | COMPRESSED_FLAG))
+#define PTR_HAS_DATA(p) ((p) != -1 && !((p) & UNWRITTEN_FLAG))
+
+#define CLUSTER_BLOCKS 16
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+
+// Inode flags
+#define INODE_COMPRESSED 0x1	/* data is stored in compressed clusters */
+
+// Per-directory Bloom filter over the names' dirent hashes, kept in the directory's
+// first block so most negative lookups read that one block and no other. Removals
+// leave their bits set; the filter is rebuilt once DIR_BLOOM_REBUILD of them pile up.
+#define DIR_BLOOM_BYTES 64
+#define DIR_BLOOM_HASHES 3
+#define DIR_BLOOM_REBUILD 16
+
+// ioctls on open files. FUSE 2 has no lseek callback, so SEEK_DATA/SEEK_HOLE
+// are offered as ioctls taking the starting offset and returning the result
+#define RUFS_IOC_SEEK_DATA	_IOWR('R', 1, int64_t)
+#define RUFS_IOC_SEEK_HOLE	_IOWR('R', 2, int64_t)
+
+// Clones a range of another rufs file into the file the ioctl is issued on, the
+// two then share its data blocks copy-on-write. FUSE 2 has no copy_file_range,
+// and the source is named by a path from the mount point since FUSE can't see
+// the caller's file descriptors.
+struct rufs_clone_range {
+	char		src_path[PATH_MAX];
+	int64_t		src_offset;
+	int64_t		src_length;			/* 0 clones up to the end of the source */
+	int64_t		dest_offset;
+};
+#define RUFS_IOC_CLONE_RANGE	_IOW('R', 3, struct rufs_clone_range)
+
+// Free space fragmentation, on any file or directory
+struct rufs_frag_stats {
+	uint32_t	free_blocks;
+	uint32_t	free_runs;			/* free buddy runs of any size */
+	uint32_t	largest_run;		/* blocks in the largest of them */
+	uint32_t	runs[BUDDY_ORDERS];	/* free buddy runs of 2^k blocks */
+};
+#define RUFS_IOC_FRAG_STATS		_IOR('R', 4, struct rufs_frag_stats)
+
+// Defragments the file or directory it is issued on, online: a file's data blocks
+// move into as few contiguous runs as free space allows, a directory's entries are
+// packed into as few blocks as hold them
+struct rufs_defrag_stats {
+	uint32_t	extents_before;		/* runs of contiguous data blocks, or directory blocks */
+	uint32_t	extents_after;
+	uint32_t	blocks_moved;		/* data blocks relocated, or directory blocks freed */
+};
+#define RUFS_IOC_DEFRAG			_IOR('R', 5, struct rufs_defrag_stats)
 
 // Contains inode, superblock, and dirent structures
 // Provides functions for bitmap operations
@@ -29,6 +108,13 @@ struct superblock {
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	stripe_devs;		/* backing files the blocks are striped over */
+	uint32_t	stripe_unit;		/* blocks per stripe */
+	uint32_t	free_inodes;		/* clear bits in the inode bitmap */
+	uint32_t	free_blocks;		/* clear bits in the data block bitmap */
+	uint32_t	clean;				/* free counts are exact, set on unmount */
+	uint32_t	r_start_blk;		/* start block of data block reference counts */
+	uint32_t	i_init_blk;			/* inode blocks below it are initialized, 0 if all are */
 };
 
 struct inode {
@@ -37,6 +123,7 @@ struct inode {
 	uint32_t	size;				/* size of the file */
 	uint32_t	type;				/* type of the file */
 	uint32_t	link;				/* link count */
+	uint32_t	flags;				/* INODE_* flags */
 	int			direct_ptr[16];		/* direct pointer to data block */
 	int			indirect_ptr[8];	/* indirect pointer to data block */
 	struct stat	vstat;				/* inode stat */
@@ -45,10 +132,29 @@ struct inode {
 struct dirent {
 	uint16_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
-	char name[208];					/* name of the directory entry */
+	char name[DIRENT_NAME_LEN];		/* name of the directory entry */
 	uint16_t len;					/* length of name */
 };
 
+// A directory data block. The name hashes of its entries are packed at the front
+// so a lookup compares all of them at once and reads only the names whose hash
+// matches. hash[i] is 0 for a free slot, names never hash to 0. The array is
+// padded to a multiple of 4 for SIMD compares, padding slots stay 0.
+#define DIRENTS_PER_BLOCK 18
+#define DIRENT_HASH_SLOTS 20
+
+struct dirent_block {
+	uint32_t hash[DIRENT_HASH_SLOTS];
+	struct dirent entries[DIRENTS_PER_BLOCK];
+	// the directory's Bloom filter, only kept in its first block
+	uint32_t bloom_valid;			/* bloom holds every name in the directory */
+	uint32_t bloom_stale;			/* names removed since bloom was built */
+	uint8_t bloom[DIR_BLOOM_BYTES];
+	char unused[BLOCK_SIZE - DIRENT_HASH_SLOTS * sizeof(uint32_t) - DIRENTS_PER_BLOCK * sizeof(struct dirent)
+			- 2 * sizeof(uint32_t) - DIR_BLOOM_BYTES];
+};
+_Static_assert(sizeof(struct dirent_block) == BLOCK_SIZE, "a directory block fills a disk block");
+
 
 /*
  * bitmap operations
@@ -67,4 +173,18 @@ uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
+// Clears bits [start, start + len), whole 64-bit words at a time where aligned
+void unset_bitmap_range(bitmap_t b, int start, int len) {
+    int i = start, end = start + len;
+    for (; i < end && (i & 63); i++) {
+        unset_bitmap(b, i);
+    }
+    for (; i + 64 <= end; i += 64) {
+        ((uint64_t *)b)[i / 64] = 0;
+    }
+    for (; i < end; i++) {
+        unset_bitmap(b, i);
+    }
+}
+
 #endif
@@ -0,0 +1,200 @@
+/*
+ *  Copyright (C) 2024 CS416/CS518 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	trace.c
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+// Operation trace recorder. Each thread that records gets its own ring of records,
+// which only it fills and only the writer thread drains, so recording takes no
+// lock: the two sides meet through the ring's head and tail indexes alone.
+// A full ring drops the record rather than making the callback wait.
+#define TRACE_RING_SIZE 4096		/* records, a power of two */
+#define TRACE_DRAIN_MS 50			/* how often the writer empties the rings */
+
+struct trace_ring {
+	struct trace_record records[TRACE_RING_SIZE];
+	unsigned int head;				/* next slot the owner fills */
+	unsigned int tail;				/* next slot the writer drains */
+	unsigned int dropped;
+	int dead;						/* the owner exited, free once drained */
+	int thread;
+	struct trace_ring *next;
+};
+
+int tracing = 0;
+FILE *trace_file = NULL;
+pthread_key_t trace_key;
+// Registered rings, the writer thread owns the list once a ring is on it
+struct trace_ring *trace_rings = NULL;
+int trace_threads = 0;
+unsigned long trace_dropped = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+pthread_t trace_thread;
+int trace_stopping = 0;
+
+uint64_t trace_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Key destructor: the thread is gone, its ring goes once the writer has drained it
+static void trace_thread_exit(void *arg) {
+	struct trace_ring *ring = arg;
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+// Returns the calling thread's ring, registering a new one on its first record
+static struct trace_ring* trace_ring_get() {
+	struct trace_ring *ring = pthread_getspecific(trace_key);
+	if (ring != NULL) {
+		return ring;
+	}
+	ring = calloc(1, sizeof(struct trace_ring));
+	if (ring == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&trace_lock);
+	ring->thread = trace_threads++;
+	ring->next = trace_rings;
+	trace_rings = ring;
+	pthread_mutex_unlock(&trace_lock);
+	pthread_setspecific(trace_key, ring);
+	return ring;
+}
+
+void trace_record(int op, const char *path, uint64_t ino, int64_t offset, uint64_t size,
+		uint32_t flags, int ret, uint64_t start_ns) {
+	if (!tracing) {
+		return;
+	}
+	struct trace_ring *ring = trace_ring_get();
+	if (ring == NULL) {
+		return;
+	}
+	unsigned int head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	struct trace_record *rec = &ring->records[head % TRACE_RING_SIZE];
+	rec->start_ns = start_ns;
+	rec->latency_ns = trace_now() - start_ns;
+	rec->ino = ino;
+	rec->offset = offset;
+	rec->size = size;
+	rec->flags = flags;
+	rec->ret = ret;
+	rec->op = op;
+	rec->thread = ring->thread;
+	rec->path[0] = '\0';
+	if (path != NULL) {
+		strncpy(rec->path, path, TRACE_PATH_LEN - 1);
+		rec->path[TRACE_PATH_LEN - 1] = '\0';
+	}
+	// publish the record only once it is complete
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Writes out what every ring holds, and frees the rings of exited threads
+static void trace_drain() {
+	pthread_mutex_lock(&trace_lock);
+	struct trace_ring **link = &trace_rings;
+	while (*link != NULL) {
+		struct trace_ring *ring = *link;
+		int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+		unsigned int tail = ring->tail;
+		unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (tail != head) {
+			// up to the end of the ring at most, the rest wraps to its start
+			unsigned int n = head - tail;
+			unsigned int slot = tail % TRACE_RING_SIZE;
+			if (n > TRACE_RING_SIZE - slot) {
+				n = TRACE_RING_SIZE - slot;
+			}
+			fwrite(&ring->records[slot], sizeof(struct trace_record), n, trace_file);
+			tail += n;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		if (dead) {
+			trace_dropped += ring->dropped;
+			*link = ring->next;
+			free(ring);
+		} else {
+			link = &ring->next;
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+	fflush(trace_file);
+}
+
+static void* trace_writer(void *arg) {
+	pthread_mutex_lock(&trace_lock);
+	while (!trace_stopping) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += TRACE_DRAIN_MS * 1000000L;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&trace_cond, &trace_lock, &until);
+		pthread_mutex_unlock(&trace_lock);
+		trace_drain();
+		pthread_mutex_lock(&trace_lock);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	return NULL;
+}
+
+// Starts recording to the trace file at path, replacing it
+int trace_start(const char *path) {
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL) {
+		perror("trace open failed");
+		return -1;
+	}
+	struct trace_header header = { TRACE_MAGIC, sizeof(struct trace_record) };
+	fwrite(&header, sizeof(header), 1, trace_file);
+	pthread_key_create(&trace_key, trace_thread_exit);
+	trace_stopping = 0;
+	pthread_create(&trace_thread, NULL, trace_writer, NULL);
+	tracing = 1;
+	return 0;
+}
+
+// Stops recording, once every record taken so far is in the trace file
+void trace_stop() {
+	if (!tracing) {
+		return;
+	}
+	tracing = 0;
+	pthread_mutex_lock(&trace_lock);
+	trace_stopping = 1;
+	pthread_cond_signal(&trace_cond);
+	pthread_mutex_unlock(&trace_lock);
+	pthread_join(trace_thread, NULL);
+	// no destructor may run on the rings of threads still running once they are freed
+	pthread_key_delete(trace_key);
+	struct trace_ring *ring;
+	for (ring = trace_rings; ring != NULL; ring = ring->next) {
+		ring->dead = 1;
+	}
+	trace_drain();
+	if (trace_dropped > 0) {
+		fprintf(stderr, "trace: %lu records dropped, rings were full\n", trace_dropped);
+	}
+	fclose(trace_file);
+	trace_file = NULL;
+}
@@ -0,0 +1,73 @@
+/*
+ *  Copyright (C) 2024 CS416/CS518 Rutgers CS
+ *	Tiny File System
+ *	File:	trace.h
+ *
+ */
+
+// Operation trace: with -o trace=FILE every FUSE callback is recorded to FILE,
+// and benchmark/replay issues a recorded trace again against a mount
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x31435254u		/* "TRC1" */
+#define TRACE_PATH_LEN 256			/* longer paths are cut, and NUL terminated */
+
+// Traced operations, one per callback of rufs_ope
+enum trace_op {
+	TRACE_GETATTR = 1,
+	TRACE_STATFS,
+	TRACE_READDIR,
+	TRACE_OPENDIR,
+	TRACE_RELEASEDIR,
+	TRACE_MKDIR,
+	TRACE_RMDIR,
+	TRACE_CREATE,
+	TRACE_OPEN,
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_READ_BUF,
+	TRACE_WRITE_BUF,
+	TRACE_UNLINK,
+	TRACE_TRUNCATE,
+	TRACE_FTRUNCATE,
+	TRACE_FLUSH,
+	TRACE_FSYNC,
+	TRACE_FSYNCDIR,
+	TRACE_UTIMENS,
+	TRACE_RELEASE,
+	TRACE_IOCTL,
+	TRACE_FALLOCATE,
+	TRACE_NOPS
+};
+
+// The trace file is a trace_header followed by trace_records. Records of one
+// thread are in order, those of different threads interleave loosely.
+struct trace_header {
+	uint32_t	magic;
+	uint32_t	record_size;		/* sizeof(struct trace_record) */
+};
+
+struct trace_record {
+	uint64_t	start_ns;			/* CLOCK_MONOTONIC when the callback was entered */
+	uint64_t	latency_ns;
+	uint64_t	ino;				/* fi->fh for callbacks given an open file, else 0 */
+	int64_t		offset;				/* file offset, or the new size for truncate */
+	uint64_t	size;
+	uint32_t	flags;				/* create/mkdir mode, open flags, fallocate mode, ioctl cmd, datasync */
+	int32_t		ret;				/* what the callback returned */
+	uint16_t	op;					/* enum trace_op */
+	uint16_t	thread;				/* recording thread, numbered from 0 */
+	char		path[TRACE_PATH_LEN];
+};
+
+int trace_start(const char *path);
+void trace_stop();
+uint64_t trace_now();
+void trace_record(int op, const char *path, uint64_t ino, int64_t offset, uint64_t size,
+	uint32_t flags, int ret, uint64_t start_ns);
+
+#endif